@@ -0,0 +1,335 @@
+/*
+ *  ReplayServer.cpp
+ *  craig2kml
+ *
+ *  A tiny HTTP server that stands in for craigslist and the google geocoder
+ *  so that craig2kml can be benchmarked offline.  Responses come from the
+ *  templates in bench/corpus.  Any other file dropped into the corpus
+ *  directory (a saved page, a cache file) is served verbatim at /<filename>.
+ *
+ *    /search?n=100          search results page with n listings
+ *    /listing/<id>.html     a listing page.  Every 10th one has no map link.
+ *    /geocode?address=...   a geocoder response
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// All of these vars are set with command line options
+int port=8631;
+const char* corpusdir="bench/corpus";
+int latencyMs=0;
+int jitterMs=0;
+double errorRate=0;
+bool verbose=false;
+
+map<string,string> corpus;
+unsigned int seedCounter=1;
+pthread_mutex_t seedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+void parse_args(int argc, char* argv[]);
+void help();
+string load_file(const string& path);
+void* handle_connection(void* arg);
+string respond(const string& path, const string& query, int& status, string& type);
+string replace_all(string str, const string& from, const string& to);
+string query_param(const string& query, const string& name);
+
+// -----------------------------------------
+int main (int argc, char* argv[])
+{
+	parse_args(argc, argv);
+	signal(SIGPIPE, SIG_IGN);
+
+	const char* templates[] = { "search.html", "search-row.html", "listing.html", "listing-map.html", "geocode.xml" };
+	for(int i=0; i<5; i++)
+	{
+		corpus[templates[i]] = load_file(string(corpusdir)+"/"+templates[i]);
+		if(corpus[templates[i]].empty())
+		{
+			cerr << "ERROR: couldn't load " << corpusdir << "/" << templates[i] << endl;
+			return 1;
+		}
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 128) != 0)
+	{
+		cerr << "ERROR: couldn't listen on port " << port << endl;
+		return 1;
+	}
+	if(verbose)
+		cerr << "listening on http://127.0.0.1:" << port << "/" << endl;
+
+	while(true)
+	{
+		int client = accept(sock, NULL, NULL);
+		if(client < 0) continue;
+
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, handle_connection, (void*)(long)client) == 0)
+			pthread_detach(thread);
+		else
+			close(client);
+	}
+	return 0;
+}
+
+
+// -----------------------------------------
+void* handle_connection(void* arg)
+{
+	int client = (int)(long)arg;
+
+	// Read until the end of the headers.  We only care about the request line.
+	string request;
+	char buf[4096];
+	while(request.find("\r\n\r\n") == string::npos)
+	{
+		ssize_t n = recv(client, buf, sizeof(buf), 0);
+		if(n <= 0) break;
+		request.append(buf, n);
+	}
+
+	string method, target;
+	istringstream line(request);
+	line >> method >> target;
+
+	string path = target, query;
+	size_t q = target.find('?');
+	if(q != string::npos)
+	{
+		path = target.substr(0, q);
+		query = target.substr(q+1);
+	}
+
+	pthread_mutex_lock(&seedMutex);
+	unsigned int seed = seedCounter++;
+	pthread_mutex_unlock(&seedMutex);
+
+	int delay = latencyMs;
+	if(jitterMs > 0)
+		delay += rand_r(&seed) % (2*jitterMs+1) - jitterMs;
+	if(delay > 0)
+		usleep(delay * 1000);
+
+	int status = 200;
+	string type = "text/html";
+	string body;
+	if(errorRate > 0 && rand_r(&seed) < errorRate * RAND_MAX)
+	{
+		status = 503;
+		body = "<html><body>Service Unavailable</body></html>";
+	}
+	else
+	{
+		body = respond(path, query, status, type);
+	}
+	if(verbose)
+		cerr << status << " " << target << endl;
+
+	char header[512];
+	snprintf(header, sizeof(header),
+		"HTTP/1.0 %d %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nConnection: close\r\n\r\n",
+		status, status==200 ? "OK" : (status==404 ? "Not Found" : "Service Unavailable"),
+		type.c_str(), (unsigned long)body.length());
+
+	string response = string(header) + body;
+	size_t sent = 0;
+	while(sent < response.length())
+	{
+		ssize_t n = send(client, response.data()+sent, response.length()-sent, 0);
+		if(n <= 0) break;
+		sent += n;
+	}
+	close(client);
+	return NULL;
+}
+
+
+// -----------------------------------------
+string respond(const string& path, const string& query, int& status, string& type)
+{
+	char host[64];
+	snprintf(host, sizeof(host), "http://127.0.0.1:%d", port);
+
+	if(path == "/search")
+	{
+		string n = query_param(query, "n");
+		int count = n.empty() ? 100 : atoi(n.c_str());
+
+		string rows;
+		for(int i=0; i<count; i++)
+		{
+			char id[32], price[32];
+			snprintf(id, sizeof(id), "%ld", 2200000000L + i);
+			snprintf(price, sizeof(price), "%ld", 1500 + ((2200000000L + i)*37)%1000);
+			string row = replace_all(corpus["search-row.html"], "{{HOST}}", host);
+			row = replace_all(row, "{{ID}}", id);
+			rows += replace_all(row, "{{PRICE}}", price);
+		}
+		return replace_all(corpus["search.html"], "{{LISTINGS}}", rows);
+	}
+
+	if(path.compare(0, 9, "/listing/") == 0)
+	{
+		string id = path.substr(9, path.find('.')-9);
+		long num = atol(id.c_str());
+		char price[32], address[128];
+		snprintf(price, sizeof(price), "%ld", 1500 + (num*37)%1000);
+		snprintf(address, sizeof(address), "%ld+Bedford+Ave+Brooklyn+NY+US", 1 + num%400);
+
+		string map = (num%10 == 9) ? "" : replace_all(corpus["listing-map.html"], "{{ADDRESS}}", address);
+		string page = replace_all(corpus["listing.html"], "{{MAP}}", map);
+		page = replace_all(page, "{{ID}}", id);
+		return replace_all(page, "{{PRICE}}", price);
+	}
+
+	if(path == "/geocode")
+	{
+		// Spread the points around Williamsburg, deterministically.
+		string address = query_param(query, "address");
+		unsigned long hash = 5381;
+		for(size_t i=0; i<address.length(); i++)
+			hash = hash*33 + (unsigned char)address[i];
+		char lat[32], lng[32];
+		snprintf(lat, sizeof(lat), "%.7f", 40.70 + (hash%1000)/25000.0);
+		snprintf(lng, sizeof(lng), "%.7f", -73.97 + ((hash/1000)%1000)/25000.0);
+
+		type = "application/xml";
+		string xml = replace_all(corpus["geocode.xml"], "{{ADDRESS}}", replace_all(address, "+", " "));
+		xml = replace_all(xml, "{{LAT}}", lat);
+		return replace_all(xml, "{{LNG}}", lng);
+	}
+
+	// Anything else is a recorded response in the corpus directory.
+	if(path.find("..") == string::npos && path.length() > 1)
+	{
+		string body = load_file(string(corpusdir)+path);
+		if(!body.empty())
+			return body;
+	}
+
+	status = 404;
+	return "<html><body>Not Found</body></html>";
+}
+
+
+// -----------------------------------------
+string load_file(const string& path)
+{
+	ifstream file(path.c_str(), ios::in | ios::binary);
+	if(!file.is_open())
+		return "";
+	ostringstream ss;
+	ss << file.rdbuf();
+	return ss.str();
+}
+
+
+// -----------------------------------------
+string replace_all(string str, const string& from, const string& to)
+{
+	size_t pos = 0;
+	while((pos = str.find(from, pos)) != string::npos)
+	{
+		str.replace(pos, from.length(), to);
+		pos += to.length();
+	}
+	return str;
+}
+
+
+// -----------------------------------------
+string query_param(const string& query, const string& name)
+{
+	string key = name + "=";
+	size_t pos = 0;
+	while(pos < query.length())
+	{
+		size_t end = query.find('&', pos);
+		if(end == string::npos) end = query.length();
+		if(query.compare(pos, key.length(), key) == 0)
+			return query.substr(pos+key.length(), end-pos-key.length());
+		pos = end+1;
+	}
+	return "";
+}
+
+
+// -----------------------------------------
+void help()
+{
+	cerr << endl;
+	cerr << "typical: craig2kml-replay [-p ####] [--latency ms] [--error-rate 0.05]" << endl;
+	cerr << "  where:" << endl;
+	cerr << "  -p (--port) port to listen on (default 8631)" << endl;
+	cerr << "  --corpus directory holding the recorded responses (default bench/corpus)" << endl;
+	cerr << "  --latency milliseconds to wait before every response" << endl;
+	cerr << "  --jitter random +/- milliseconds added to the latency" << endl;
+	cerr << "  --error-rate fraction of requests answered with a 503" << endl;
+	cerr << "  -v (--verbose) print every request to stderr";
+	cerr << endl;
+}
+
+
+// -----------------------------------------
+void parse_args(int argc, char* argv[])
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		bool hasValue = (i+1 < argc);
+		if((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) && hasValue)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--corpus") == 0 && hasValue)
+		{
+			corpusdir = argv[++i];
+		}
+		else if(strcmp(argv[i], "--latency") == 0 && hasValue)
+		{
+			latencyMs = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--jitter") == 0 && hasValue)
+		{
+			jitterMs = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--error-rate") == 0 && hasValue)
+		{
+			errorRate = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0)
+		{
+			verbose = true;
+		}
+		else
+		{
+			help();
+			exit(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1);
+		}
+	}
+}
@@ -0,0 +1,561 @@
+/*
+ *  bench.cpp
+ *  craig2kml
+ *
+ *  Offline benchmarks.  Microbenchmarks run against the templates in
+ *  bench/corpus.  The end-to-end runs (--e2e) drive the craig2kml binary
+ *  against craig2kml-replay; bench/run.sh starts both.
+ *
+ *  Every result is printed as one "name<TAB>value<TAB>unit" line, always in
+ *  the same order, so two runs can be compared with diff or --compare.
+ *  Each microbenchmark reports its time and its heap allocations per call.
+ *  micro.pool_load_100 shows how the CPU stage scales with cores.
+ *  micro.viewport_top20_10000 is one --bbox --top 20 lookup, and
+ *  micro.store_keyword_10000 one --from-store --keyword query.
+ *
+ *  --check runs the checks in bench/checks.cpp instead.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include "Webpage.h"
+#include "Craig2KML.h"
+#include "WorkerPool.h"
+#include "ListingStore.h"
+
+// All of these vars are set with command line options
+const char* corpusdir="bench/corpus";
+const char* exe="./craig2kml";
+const char* configfile="bench/bench.config";
+int port=8631;
+bool e2e=false;
+double minSeconds=0.25;
+vector<int> counts;
+vector<int> concurrency;
+vector<char*> extraArgs;
+
+// The documents the microbenchmarks work on
+const char* cachedURL="http://127.0.0.1/listing/2200000001.html";
+string listingHtml;
+string searchHtml;
+Webpage listingPage;
+Webpage searchPage;
+WorkerPool* pool=NULL;
+map<string,string> config;
+vector<const Listing*> viewportListings;
+ListingStore store;
+
+void parse_args(int argc, char* argv[]);
+void help();
+string load_file(const string& path);
+string replace_all(string str, const string& from, const string& to);
+vector<int> parse_list(const char* str);
+double measure(void (*fn)());
+double count_allocations(void (*fn)());
+void micro(const string& name, void (*fn)(), double scale, const string& unit);
+void report(const string& name, double value, const string& unit);
+void run_e2e(int count, int procs);
+int compare(const char* before, const char* after);
+int run_checks();
+
+// -----------------------------------------
+// A Webpage whose contents can be set directly, so tidy_me can be timed on its own.
+class BenchPage : public Webpage {
+public:
+	void setContents(const string& html) { contents = html; }
+	const string& getContents() { return contents; }
+};
+
+void bench_tidy_me()
+{
+	BenchPage page;
+	page.setContents(listingHtml);
+	page.tidy_me();
+}
+
+void bench_load()
+{
+	Webpage page;
+	page.load(listingHtml);
+}
+
+void bench_open_cached()
+{
+	Webpage page;
+	page.open(cachedURL, false, true);
+}
+
+void bench_xpath_listing()
+{
+	Arena arena;
+	listingPage.getNodeAttribute(config["craigslist_google_maps_link"], "href", &arena);
+	listingPage.getNodeAsString(config["craigslist_item_description"], &arena);
+	listingPage.getNodeContents("//title", &arena);
+}
+
+void bench_get_links()
+{
+	Arena arena;
+	searchPage.getLinks(config["craigslist_links"], &arena);
+}
+
+void load_listing(void* arg)
+{
+	Webpage page;
+	page.load(listingHtml);
+}
+
+// 100 listings tidied and parsed on the pool, the way craig2kml's CPU stage does them
+void bench_pool_load()
+{
+	for(int i=0; i<100; i++)
+		pool->submit(load_listing, NULL);
+	pool->wait();
+}
+
+void bench_describe()
+{
+	Arena arena;
+	Description format;
+	listingPage.getNodeDescription(config["craigslist_item_description"], format, cachedURL, &arena);
+}
+
+// Bytes of KML for 100 placemarks with descriptions made the given way
+double kml_bytes(const char* mode, bool balloonTemplate)
+{
+	Arena arena;
+	Description format;
+	format.setMode(mode);
+	Craig2KML c2k("bench", false);
+	c2k.setBalloonTemplate(balloonTemplate);
+	string description = listingPage.getNodeDescription(config["craigslist_item_description"], format, cachedURL, &arena).str();
+	for(int i=0; i<100; i++)
+	{
+		// Real listings only share their boilerplate
+		char posting[64];
+		sprintf(posting, "\nPostingID: %u", 2200000000U + i);
+		c2k.addMappable("listing", description + posting, 40.70 + i/2500.0, -73.97);
+	}
+	return c2k.serialize().length();
+}
+
+// A viewport over a sixth of the area the listings are spread over
+void bench_viewport()
+{
+	Bbox box(40.76, 40.72, -73.93, -73.97);
+	Listing::newestInside(viewportListings, box, 20);
+}
+
+// Only the titles of one listing in seven have the keyword
+void bench_store()
+{
+	ListingStore::Filter filter;
+	filter.keyword = "studio";
+	store.select(filter);
+}
+
+template<int N>
+void bench_serialize()
+{
+	Arena arena;
+	Craig2KML c2k("bench", false);
+	string description = listingPage.getNodeAsString(config["craigslist_item_description"], &arena).str();
+	for(int i=0; i<N; i++)
+	{
+		char title[64];
+		sprintf(title, "listing %d", i);
+		if(i%10 == 9)
+			c2k.addUnmappable(title, description);
+		else
+			c2k.addMappable(title, description, 40.70 + (i%100)/2500.0, -73.97 + (i/100)/2500.0);
+	}
+	c2k.serialize();
+}
+
+
+// -----------------------------------------
+int main (int argc, char* argv[])
+{
+	parse_args(argc, argv);
+
+	config["craigslist_links"]				= "//body/blockquote/p/a";
+	config["craigslist_google_maps_link"]	= "//div[@id='userbody']//small/a";
+	config["craigslist_item_description"]	= "//div[@id='userbody']";
+
+	// Fill in the templates the same way craig2kml-replay does.
+	string dir(corpusdir);
+	string row = replace_all(load_file(dir+"/search-row.html"), "{{HOST}}", "http://127.0.0.1");
+	string rows;
+	for(int i=0; i<100; i++)
+	{
+		char id[32];
+		sprintf(id, "%u", 2200000000U + i);
+		rows += replace_all(replace_all(row, "{{ID}}", id), "{{PRICE}}", "1850");
+	}
+	searchHtml = replace_all(load_file(dir+"/search.html"), "{{LISTINGS}}", rows);
+	string map = replace_all(load_file(dir+"/listing-map.html"), "{{ADDRESS}}", "123+Bedford+Ave+Brooklyn+NY+US");
+	listingHtml = replace_all(load_file(dir+"/listing.html"), "{{MAP}}", map);
+	listingHtml = replace_all(replace_all(listingHtml, "{{ID}}", "2200000001"), "{{PRICE}}", "1850");
+
+	if(listingHtml.empty() || searchHtml.empty() || !listingPage.load(listingHtml) || !searchPage.load(searchHtml))
+	{
+		cerr << "ERROR: couldn't load the corpus from " << corpusdir << endl;
+		return 1;
+	}
+
+	// Seed a cache directory so Webpage::open never touches the network.
+	char cachedir[] = "/tmp/craig2kml-bench-XXXXXX";
+	Webpage::cacheDirectory = mkdtemp(cachedir);
+	{
+		BenchPage page;
+		page.setContents(listingHtml);
+		page.tidy_me();
+		ofstream cache(Webpage::cachePath(cachedURL).c_str());
+		cache << page.getContents();
+	}
+
+	cout << "# craig2kml benchmark" << endl;
+	micro("micro.tidy_me", bench_tidy_me, 1e6, "us/op");
+	micro("micro.webpage_load", bench_load, 1e6, "us/op");
+	micro("micro.webpage_open_cached", bench_open_cached, 1e6, "us/op");
+	micro("micro.xpath_listing", bench_xpath_listing, 1e6, "us/op");
+	micro("micro.xpath_get_links_100", bench_get_links, 1e6, "us/op");
+	micro("micro.serialize_100", bench_serialize<100>, 1e3, "ms/op");
+	micro("micro.serialize_1000", bench_serialize<1000>, 1e3, "ms/op");
+	micro("micro.describe_html", bench_describe, 1e6, "us/op");
+
+	// 10000 listings spread evenly over part of Brooklyn, found over 10 days
+	Arena viewportArena;
+	vector<Listing> known(10000);
+	for(int i=0; i<10000; i++)
+	{
+		char id[32];
+		sprintf(id, "%u", 2200000000U + i);
+		known[i].id = viewportArena.copy(id);
+		known[i].title = viewportArena.copy(i%7 ? "$1850 / 1br - Sunny loft near the train" : "$1450 / 0br - Sunny studio near the train");
+		known[i].url = viewportArena.copy(string("http://127.0.0.1/listing/") + id + ".html");
+		known[i].description = viewportArena.copy("Quiet block, laundry in the building, close to the L.");
+		known[i].lat = 40.70 + (i%100)/1000.0;
+		known[i].lng = -74.00 + (i/100)/1000.0;
+		known[i].found = 1300000000 + (i%10)*86400;
+		known[i].status = Listing::MAPPABLE;
+		viewportListings.push_back(&known[i]);
+	}
+	micro("micro.viewport_top20_10000", bench_viewport, 1e6, "us/op");
+
+	// The same listings, stored by ten crawls of 1000
+	string storefile = Webpage::cacheDirectory + "/listings.store";
+	for(int i=0; i<10000; i+=1000)
+		ListingStore::append(storefile, vector<const Listing*>(viewportListings.begin()+i, viewportListings.begin()+i+1000));
+	if(store.open(storefile))
+		micro("micro.store_keyword_10000", bench_store, 1e3, "ms/op");
+	unlink(storefile.c_str());
+
+	// How big the output is with each description mode
+	report("size.kml_100.full", kml_bytes("full", false), "bytes");
+	report("size.kml_100.html", kml_bytes("html", false), "bytes");
+	report("size.kml_100.html_template", kml_bytes("html", true), "bytes");
+	report("size.kml_100.text", kml_bytes("text", false), "bytes");
+	report("size.kml_100.summary", kml_bytes("summary", false), "bytes");
+
+	// How well the CPU stage scales: one thread, then one per core
+	Webpage::init();
+	pool = new WorkerPool(1);
+	double single = measure(bench_pool_load);
+	delete pool;
+	pool = new WorkerPool(0);
+	double parallel = measure(bench_pool_load);
+	report("micro.pool_load_100.j1", single*1e3, "ms/op");
+	report("micro.pool_load_100.jmax", parallel*1e3, "ms/op");
+	report("micro.pool_load_100.speedup", single/parallel, "x");
+	report("micro.pool_load_100.threads", pool->size(), "threads");
+	delete pool;
+
+	if(e2e)
+	{
+		for(size_t c=0; c<counts.size(); c++)
+			for(size_t p=0; p<concurrency.size(); p++)
+				run_e2e(counts[c], concurrency[p]);
+	}
+
+	unlink(Webpage::cachePath(cachedURL).c_str());
+	rmdir(cachedir);
+	xmlCleanupParser();
+	return 0;
+}
+
+
+// -----------------------------------------
+// Best-of-three average time per call, in seconds.
+double measure(void (*fn)())
+{
+	fn();
+
+	double best = -1;
+	for(int rep=0; rep<3; rep++)
+	{
+		int n = 0;
+		double start = Metrics::now();
+		double elapsed;
+		do {
+			fn();
+			n++;
+			elapsed = Metrics::now() - start;
+		} while(elapsed < minSeconds);
+
+		if(best < 0 || elapsed/n < best)
+			best = elapsed/n;
+	}
+	return best;
+}
+
+
+// -----------------------------------------
+// Heap allocations (through operator new) made by one call.  libxml and
+// tidy allocate with malloc and aren't counted.
+double count_allocations(void (*fn)())
+{
+	Metrics::enabled = true;
+	unsigned long before = Metrics::allocations;
+	fn();
+	unsigned long after = Metrics::allocations;
+	Metrics::enabled = false;
+	return after - before;
+}
+
+
+// -----------------------------------------
+void micro(const string& name, void (*fn)(), double scale, const string& unit)
+{
+	report(name, measure(fn)*scale, unit);
+	report(name+".allocs", count_allocations(fn), "allocs/op");
+}
+
+
+// -----------------------------------------
+// Run 'procs' copies of craig2kml at once, each mapping 'count' listings.
+void run_e2e(int count, int procs)
+{
+	char url[256], max[32];
+	sprintf(url, "http://127.0.0.1:%d/search?n=%d", port, count);
+	sprintf(max, "%d", count);
+
+	vector<char*> args;
+	args.push_back((char*)exe);
+	args.push_back((char*)"-c");
+	args.push_back((char*)configfile);
+	args.push_back((char*)"-u");
+	args.push_back(url);
+	args.push_back((char*)"-m");
+	args.push_back(max);
+	// Each copy writes its own file in the bench's temporary directory
+	args.push_back((char*)"-o");
+	size_t outArg = args.size();
+	args.push_back(NULL);
+	args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+	args.push_back(NULL);
+	vector<string> outfiles;
+	for(int i=0; i<procs; i++)
+	{
+		char outfile[64];
+		sprintf(outfile, "/e2e-%d.kml", i);
+		outfiles.push_back(Webpage::cacheDirectory + outfile);
+	}
+
+	double start = Metrics::now();
+	for(int i=0; i<procs; i++)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
+		{
+			int devnull = ::open("/dev/null", O_WRONLY);
+			dup2(devnull, 1);
+			dup2(devnull, 2);
+			args[outArg] = (char*)outfiles[i].c_str();
+			execv(exe, &args[0]);
+			_exit(127);
+		}
+	}
+
+	int failures = 0;
+	for(int i=0; i<procs; i++)
+	{
+		int status;
+		wait(&status);
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failures++;
+	}
+	double elapsed = Metrics::now() - start;
+	for(int i=0; i<procs; i++)
+		unlink(outfiles[i].c_str());
+
+	char name[64];
+	sprintf(name, "e2e.n%d.c%d", count, procs);
+	report(string(name)+".wall", elapsed, "s");
+	report(string(name)+".listings_per_s", count*procs/elapsed, "1/s");
+	report(string(name)+".failures", failures, "procs");
+}
+
+
+// -----------------------------------------
+void report(const string& name, double value, const string& unit)
+{
+	char line[256];
+	sprintf(line, "%s\t%.3f\t%s", name.c_str(), value, unit.c_str());
+	cout << line << endl;
+}
+
+
+// -----------------------------------------
+// Print the relative change of every metric between two result files.
+int compare(const char* before, const char* after)
+{
+	map<string,double> old;
+	string line, name, unit;
+	double value;
+
+	ifstream a(before);
+	while(getline(a, line))
+	{
+		istringstream ss(line);
+		if(line[0]!='#' && ss >> name >> value)
+			old[name] = value;
+	}
+
+	ifstream b(after);
+	while(getline(b, line))
+	{
+		istringstream ss(line);
+		if(line.empty() || line[0]=='#' || !(ss >> name >> value >> unit))
+			continue;
+
+		char out[256];
+		if(old.find(name) == old.end() || old[name] == 0)
+			sprintf(out, "%-36s %12.3f %-6s (new)", name.c_str(), value, unit.c_str());
+		else
+			sprintf(out, "%-36s %12.3f %-6s %+7.1f%%", name.c_str(), value, unit.c_str(), (value-old[name])/old[name]*100);
+		cout << out << endl;
+	}
+	return 0;
+}
+
+
+// -----------------------------------------
+string load_file(const string& path)
+{
+	ifstream file(path.c_str(), ios::in | ios::binary);
+	ostringstream ss;
+	if(file.is_open())
+		ss << file.rdbuf();
+	return ss.str();
+}
+
+
+// -----------------------------------------
+string replace_all(string str, const string& from, const string& to)
+{
+	size_t pos = 0;
+	while((pos = str.find(from, pos)) != string::npos)
+	{
+		str.replace(pos, from.length(), to);
+		pos += to.length();
+	}
+	return str;
+}
+
+
+// -----------------------------------------
+vector<int> parse_list(const char* str)
+{
+	vector<int> list;
+	string item;
+	istringstream ss(str);
+	while(getline(ss, item, ','))
+		list.push_back(atoi(item.c_str()));
+	return list;
+}
+
+
+// -----------------------------------------
+void help()
+{
+	cerr << endl;
+	cerr << "typical: craig2kml-bench [--e2e] [-- craig2kml options]" << endl;
+	cerr << "  where:" << endl;
+	cerr << "  --corpus directory holding the recorded responses (default bench/corpus)" << endl;
+	cerr << "  --min-time seconds to spend on each microbenchmark repetition" << endl;
+	cerr << "  --e2e also run craig2kml end to end against craig2kml-replay" << endl;
+	cerr << "  --exe the craig2kml binary to run (default ./craig2kml)" << endl;
+	cerr << "  -p (--port) the port craig2kml-replay is listening on (default 8631)" << endl;
+	cerr << "  --counts comma separated listing counts (default 10,50,100)" << endl;
+	cerr << "  --concurrency comma separated numbers of simultaneous runs (default 1,4)" << endl;
+	cerr << "  --compare <before> <after> print the change between two result files" << endl;
+	cerr << "  --check run the checks in bench/checks.cpp and nothing else" << endl;
+	cerr << "  Anything after -- is passed to craig2kml.";
+	cerr << endl;
+}
+
+
+// -----------------------------------------
+void parse_args(int argc, char* argv[])
+{
+	counts = parse_list("10,50,100");
+	concurrency = parse_list("1,4");
+
+	for(int i = 1; i < argc; ++i)
+	{
+		bool hasValue = (i+1 < argc);
+		if(strcmp(argv[i], "--corpus") == 0 && hasValue)
+		{
+			corpusdir = argv[++i];
+		}
+		else if(strcmp(argv[i], "--min-time") == 0 && hasValue)
+		{
+			minSeconds = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--e2e") == 0)
+		{
+			e2e = true;
+		}
+		else if(strcmp(argv[i], "--exe") == 0 && hasValue)
+		{
+			exe = argv[++i];
+		}
+		else if((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) && hasValue)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--counts") == 0 && hasValue)
+		{
+			counts = parse_list(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--concurrency") == 0 && hasValue)
+		{
+			concurrency = parse_list(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--compare") == 0 && i+2 < argc)
+		{
+			exit(compare(argv[i+1], argv[i+2]));
+		}
+		else if(strcmp(argv[i], "--check") == 0)
+		{
+			exit(run_checks());
+		}
+		else if(strcmp(argv[i], "--") == 0)
+		{
+			extraArgs.assign(argv+i+1, argv+argc);
+			break;
+		}
+		else
+		{
+			help();
+			exit(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 ? 0 : 1);
+		}
+	}
+}
@@ -0,0 +1,244 @@
+/*
+ *  checks.cpp
+ *  craig2kml
+ *
+ *  Quick checks of the cases that are easy to get wrong and hard to see
+ *  in a KML file: run with craig2kml-bench --check, or bench/checks.sh.
+ *  Each check prints one "ok" or "FAIL" line.  They only use files in a
+ *  scratch directory, never the network.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <libxml/parser.h>
+#include "Gazetteer.h"
+#include "Description.h"
+#include "ListingStore.h"
+
+using namespace std;
+
+static int failures = 0;
+static string scratch;
+
+// -----------------------------------------
+static void check(const string& name, bool passed)
+{
+	cout << (passed ? "ok  " : "FAIL") << "\t" << name << endl;
+	if(!passed)
+		failures++;
+}
+
+// -----------------------------------------
+static void write_file(const string& path, const string& contents)
+{
+	ofstream out(path.c_str(), ios::binary);
+	out << contents;
+}
+
+// -----------------------------------------
+static string read_file(const string& path)
+{
+	ifstream in(path.c_str(), ios::binary);
+	stringstream contents;
+	contents << in.rdbuf();
+	return contents.str();
+}
+
+
+// -----------------------------------------
+// A lookup is a hit only when the street, its type and the city all match
+// one address.  Anything less has to be a miss, not the nearest guess.
+static void check_gazetteer()
+{
+	string csv = scratch + "/addresses.csv";
+	string index = scratch + "/addresses.idx";
+	write_file(csv,
+		"LON,LAT,NUMBER,STREET,CITY,REGION\n"
+		"-89.65,39.78,123,Main St,Springfield,IL\n"
+		"-73.95,40.71,123,Main St,Brooklyn,NY\n"
+		"-73.96,40.72,45,Bedford Ave,Brooklyn,NY\n"
+		"-73.96,40.72,45,Bedford Ave,Brooklyn,NY\n");
+
+	Gazetteer gazetteer;
+	if(!Gazetteer::build(csv, index) || !gazetteer.open(index))
+	{
+		check("gazetteer.build", false);
+		return;
+	}
+
+	float lat = 0, lng = 0;
+	check("gazetteer.exact", gazetteer.lookup("45+Bedford+Avenue+Brooklyn+NY", lat, lng) && lat > 40.7 && lng < -73.9);
+	check("gazetteer.zip_and_country", gazetteer.lookup("123+Main+St+Brooklyn+NY+11211+US", lat, lng) && lng > -74 && lng < -73.9);
+	check("gazetteer.wrong_city_misses", !gazetteer.lookup("123+Main+St+Portland+OR+97201+US", lat, lng));
+	check("gazetteer.wrong_street_type_misses", !gazetteer.lookup("123+Main+Ave+Brooklyn+NY", lat, lng));
+	check("gazetteer.ambiguous_misses", !gazetteer.lookup("123+Main+St", lat, lng));
+
+	unlink(csv.c_str());
+	unlink(index.c_str());
+}
+
+
+// -----------------------------------------
+static size_t occurrences(const string& str, const string& what)
+{
+	size_t n = 0;
+	for(size_t at = str.find(what); at != string::npos; at = str.find(what, at+1))
+		n++;
+	return n;
+}
+
+
+// -----------------------------------------
+// Every mode but full stays under description_max_bytes, with its tags
+// closed and no entity cut in half, and a summary only links to the
+// listing when the link fits.
+static void check_description()
+{
+	const char* html =
+		"<html><body><div id='userbody'>Nice  2BR &amp; sunny apt<br/>near <b>train</b>. "
+		"<img src='x.jpg'/><script>alert(1)</script><!-- CLTAG --><p>Big   kitchen</p>"
+		"<ul><li>heat incl</li><li>no fee</li></ul><a href='http://x.com/a?b=1&amp;c=2'>map</a></div></body></html>";
+	xmlDocPtr doc = xmlParseMemory(html, strlen(html));
+	xmlNodePtr body = doc ? xmlDocGetRootElement(doc)->children : NULL;
+	xmlNodePtr node = body ? body->children : NULL;
+	if(node == NULL)
+	{
+		check("description.parse", false);
+		if(doc) xmlFreeDoc(doc);
+		return;
+	}
+
+	const char* modes[] = { "html", "text", "summary", NULL };
+	const size_t caps[] = { 0, 90, 30, 21 };
+	const char* tags[] = { "b", "p", "ul", "li", "a", NULL };
+	string url = "http://127.0.0.1/listing/2200000001.html";
+	for(int m=0; modes[m]; m++)
+	{
+		for(size_t c=0; c<sizeof(caps)/sizeof(caps[0]); c++)
+		{
+			Description description;
+			description.setMode(modes[m]);
+			description.maxBytes = caps[c];
+			description.summaryBytes = 60;
+			string out = description.render(node, url);
+
+			char name[64];
+			snprintf(name, sizeof(name), "description.%s_%lu", modes[m], (unsigned long)caps[c]);
+			bool passed = !out.empty() && (caps[c] == 0 || out.length() <= caps[c]);
+			passed = passed && out.find("alert") == string::npos && out.find("<img") == string::npos;
+			passed = passed && occurrences(out, "&") == occurrences(out, "&amp;");
+			for(int t=0; tags[t]; t++)
+				passed = passed && occurrences(out, string("<")+tags[t]+">") + occurrences(out, string("<")+tags[t]+" ") ==
+					occurrences(out, string("</")+tags[t]+">");
+			if(strcmp(modes[m], "summary") == 0)
+				passed = passed && (out.find(url) != string::npos) == (caps[c] == 0 || caps[c] >= 90);
+			check(name, passed);
+		}
+	}
+	xmlFreeDoc(doc);
+}
+
+
+// -----------------------------------------
+// The end of a store that a crash left half written is cut off by the
+// next append.  A file that isn't a store, or a store with a damaged
+// block anywhere else, is never written to.  And a listing whose newest
+// copy doesn't pass a filter doesn't come out as an older copy that does.
+static void check_store()
+{
+	Arena arena;
+	Listing cheap;
+	cheap.title = arena.copy("$900 / studio - Small but sunny");
+	cheap.url = arena.copy("http://127.0.0.1/listing/2200000001.html");
+	cheap.id = Listing::postingId(cheap.url);
+	cheap.status = Listing::MAPPABLE;
+	cheap.found = 1300000000;
+	Listing raised = cheap;
+	raised.title = arena.copy("$1900 / studio - Small but sunny");
+	raised.found = 1300086400;
+	vector<const Listing*> first(1, &cheap);
+	vector<const Listing*> second(1, &raised);
+
+	string storefile = scratch + "/listings.store";
+	bool appended = ListingStore::append(storefile, first);
+	size_t firstBlock = read_file(storefile).length();
+	appended = appended && ListingStore::append(storefile, second);
+	string whole = read_file(storefile);
+	check("store.append", appended && !whole.empty());
+
+	ListingStore::Filter underTwoThousand;
+	underTwoThousand.maxPrice = 2000;
+	ListingStore::Filter underThousand;
+	underThousand.maxPrice = 1000;
+	{
+		ListingStore store;
+		bool opened = store.open(storefile);
+		check("store.newest_copy_passes", opened && store.select(underTwoThousand).size() == 1 &&
+			store.select(underTwoThousand)[0].found == raised.found);
+		check("store.stale_copy_not_returned", opened && store.select(underThousand).empty());
+	}
+
+	// Cut the second block short, as a crash partway through writing it would
+	write_file(storefile, whole.substr(0, whole.length()-5));
+	{
+		ListingStore store;
+		check("store.torn_tail_ignored", store.open(storefile) && store.size() == 1);
+	}
+	ListingStore::append(storefile, second);
+	{
+		ListingStore store;
+		check("store.torn_tail_cut", read_file(storefile) == whole && store.open(storefile) && store.size() == 2);
+	}
+
+	// A damaged header on a block that isn't the last
+	ListingStore::append(storefile, first);
+	string damaged = read_file(storefile);
+	damaged[firstBlock] = 'X';
+	write_file(storefile, damaged);
+	{
+		ListingStore store;
+		check("store.damaged_refused", !ListingStore::append(storefile, first) && read_file(storefile) == damaged &&
+			!store.open(storefile));
+	}
+
+	// Not a store at all: the KML file it was meant to go next to, say
+	string kmlfile = scratch + "/listings.kml";
+	string kml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<kml xmlns=\"http://www.opengis.net/kml/2.2\"/>\n";
+	write_file(kmlfile, kml);
+	{
+		ListingStore store;
+		check("store.foreign_file_untouched", !ListingStore::append(kmlfile, first) && read_file(kmlfile) == kml &&
+			!store.open(kmlfile));
+	}
+
+	unlink(storefile.c_str());
+	unlink(kmlfile.c_str());
+}
+
+
+// -----------------------------------------
+int run_checks()
+{
+	char dir[] = "/tmp/craig2kml-checks-XXXXXX";
+	if(!mkdtemp(dir))
+	{
+		cerr << "ERROR: couldn't make a scratch directory" << endl;
+		return 1;
+	}
+	scratch = dir;
+
+	check_gazetteer();
+	check_description();
+	check_store();
+
+	rmdir(dir);
+	cout << (failures ? "FAILED " : "passed ") << "(" << failures << " failures)" << endl;
+	return failures ? 1 : 0;
+}
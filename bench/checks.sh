@@ -0,0 +1,12 @@
+#!/bin/sh
+#
+# Checks the cases that are easy to get wrong, from the top of the
+# source tree, without the replay server:
+#
+#   make
+#   bench/checks.sh
+#
+# Exits non-zero if any check fails.  See bench/checks.cpp.  The checks
+# that expect craig2kml to refuse a file print its ERROR line too.
+
+./craig2kml-bench --check
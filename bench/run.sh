@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Runs the offline benchmark suite from the top of the source tree:
+#
+#   make config=release
+#   bench/run.sh > after.txt
+#   ./craig2kml-bench --compare before.txt after.txt
+#
+# LATENCY, JITTER and ERROR_RATE control the replay server.  COUNTS and
+# CONCURRENCY are comma separated lists.  Arguments are passed on to craig2kml.
+
+LATENCY=${LATENCY:-20}
+JITTER=${JITTER:-5}
+ERROR_RATE=${ERROR_RATE:-0}
+COUNTS=${COUNTS:-10,50,100}
+CONCURRENCY=${CONCURRENCY:-1,4}
+PORT=8631
+
+./craig2kml-replay -p $PORT --latency $LATENCY --jitter $JITTER --error-rate $ERROR_RATE &
+SERVER=$!
+trap 'kill $SERVER' EXIT
+sleep 1
+
+echo "# latency=$LATENCY jitter=$JITTER error_rate=$ERROR_RATE"
+./craig2kml-bench -p $PORT --e2e --counts $COUNTS --concurrency $CONCURRENCY -- "$@"
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Checks that a sharded crawl writes the same KML as a single process,
+# against the replay server, from the top of the source tree:
+#
+#   make
+#   bench/shards.sh
+#
+# SHARDS and COUNT set the number of worker processes and listings.
+# Arguments are passed on to both runs of craig2kml.
+
+SHARDS=${SHARDS:-4}
+COUNT=${COUNT:-100}
+PORT=8631
+OUT=${TMPDIR:-/tmp}/craig2kml-shards.$$
+
+./craig2kml-replay -p $PORT &
+SERVER=$!
+trap 'kill $SERVER; rm -f $OUT.single.kml $OUT.sharded.kml' EXIT
+sleep 1
+
+URL="http://127.0.0.1:$PORT/search?n=$COUNT"
+./craig2kml -c bench/bench.config -u "$URL" -m $COUNT -o $OUT.single.kml "$@" 2>/dev/null || exit 1
+./craig2kml -c bench/bench.config -u "$URL" -m $COUNT -o $OUT.sharded.kml --shards $SHARDS "$@" 2>/dev/null || exit 1
+
+# The root folder's description has the time of the run in it.
+if diff -I '<description>".*" on ' $OUT.single.kml $OUT.sharded.kml; then
+	echo "identical ($COUNT listings, $SHARDS shards)"
+else
+	exit 1
+fi
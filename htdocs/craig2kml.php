@@ -15,7 +15,8 @@ if(isset($_REQUEST['url']))
 		$kmlurl		=	"{$urlbase}/{$kmlfile}";
 		$logfile	=	"{$kmldir}/{$filebase}.log";
 		$logurl		=	"{$urlbase}/{$logfile}";
-		$cmd = sprintf('LD_LIBRARY_PATH="%s:$LD_LIBRARY_PATH" %s -v -o "%s" -u "%s" -c %s -d %s', 
+		// The page below gives up after 15 seconds.
+		$cmd = sprintf('LD_LIBRARY_PATH="%s:$LD_LIBRARY_PATH" %s -v --deadline 12 -o "%s" -u "%s" -c %s -d %s', 
 			$ld_library_path, 
 			$craig2kml_exe, 
 			$kmlfile, $url,
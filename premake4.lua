@@ -1,33 +1,56 @@
 solution "Craig2kmlSolution" 
 	configurations { "Debug", "Release" }
 	
+	configuration "Debug"
+		defines { "DEBUG" }
+		flags { "Symbols" }
+		
+	configuration "Release"
+		defines { "NDEBUG" }
+		flags { "Optimize" }
+
+-- Everything that links against the craig2kml sources needs these
+local craig2kml_links = { 
+	"xml2", "tidy", "pcrecpp", "curl", "z", "pthread", "m",
+	"kmlbase", "kmlconvenience", "kmldom", "kmlengine" }
+local craig2kml_libdirs = { 
+	"/opt/local/lib", 
+	"/usr/local/lib", 
+	os.findlib("kmlbase"),
+	os.findlib("tidy"),
+	os.findlib("xml2"), 
+	os.findlib("curl")   }
+local craig2kml_includedirs = { 
+	"/opt/local/include",
+	"/opt/local/include/libxml2",
+	"/usr/include/libxml2",
+	"/usr/local/include/tidy",
+	"/usr/include/tidy",
+	"/usr/local/include/kml/**" }
+	
 -- A project defines one build target
 project "craig2kml"
 	kind "ConsoleApp"
 	language "C++"
 	files { "src/*.h", "src/*.cpp" }
-	links { 
-		"xml2", "tidy", "pcrecpp", "curl", "z", "pthread", "m",
-		"kmlbase", "kmlconvenience", "kmldom", "kmlengine" }
-	libdirs { 
-		"/opt/local/lib", 
-		"/usr/local/lib", 
-		os.findlib("kmlbase"),
-		os.findlib("tidy"),
-		os.findlib("xml2"), 
-		os.findlib("curl")   }
-	includedirs { 
-		"/opt/local/include",
-		"/opt/local/include/libxml2",
-		"/usr/include/libxml2",
-		"/usr/local/include/tidy",
-		"/usr/include/tidy",
-		"/usr/local/include/kml/**" }
-	
-configuration "Debug"
-	defines { "DEBUG" }
-	flags { "Symbols" }
-	
-configuration "Release"
-	defines { "NDEBUG" }
-	flags { "Optimize" }  
\ No newline at end of file
+	links(craig2kml_links)
+	libdirs(craig2kml_libdirs)
+	includedirs(craig2kml_includedirs)
+
+-- Offline benchmarks and checks.  See bench/run.sh and bench/checks.sh
+project "craig2kml-bench"
+	kind "ConsoleApp"
+	language "C++"
+	files { "src/*.h", "src/*.cpp", "bench/bench.cpp", "bench/checks.cpp" }
+	excludes { "src/main.cpp" }
+	links(craig2kml_links)
+	libdirs(craig2kml_libdirs)
+	includedirs(craig2kml_includedirs)
+	includedirs { "src" }
+
+-- Stands in for craigslist and the geocoder during the benchmarks
+project "craig2kml-replay"
+	kind "ConsoleApp"
+	language "C++"
+	files { "bench/ReplayServer.cpp" }
+	links { "pthread" }
@@ -0,0 +1,103 @@
+/*
+ *  Arena.cpp
+ *  craig2kml
+ *
+ */
+
+#include "Arena.h"
+#include <algorithm>
+
+// Blocks double in size up to this
+static const size_t maxBlockSize = 1024*1024;
+
+// -------------------------------------------------------------
+Arena::Arena(size_t firstBlockSize)
+{
+	current = NULL;
+	remaining = 0;
+	blockSize = firstBlockSize;
+	used = 0;
+}
+
+// -------------------------------------------------------------
+Arena::~Arena()
+{
+	for(size_t i=0; i<blocks.size(); i++)
+	{
+		delete[] blocks[i];
+	}
+}
+
+// -------------------------------------------------------------
+void Arena::reset()
+{
+	for(size_t i=0; i<blocks.size(); i++)
+	{
+		delete[] blocks[i];
+	}
+	blocks.clear();
+	current = NULL;
+	remaining = 0;
+	used = 0;
+}
+
+// -------------------------------------------------------------
+char* Arena::alloc(size_t n)
+{
+	used += n;
+	
+	// Big allocations get a block of their own, so the rest of the current block isn't wasted.
+	if(n > blockSize/4)
+	{
+		char* block = new char[n];
+		blocks.push_back(block);
+		return block;
+	}
+	
+	if(n > remaining)
+	{
+		current = new char[blockSize];
+		blocks.push_back(current);
+		remaining = blockSize;
+		blockSize = min(blockSize*2, maxBlockSize);
+	}
+	
+	char* p = current;
+	current += n;
+	remaining -= n;
+	return p;
+}
+
+// -------------------------------------------------------------
+StringRef Arena::copy(const char* str, size_t n)
+{
+	char* p = alloc(n+1);
+	memcpy(p, str, n);
+	p[n] = '\0';
+	return StringRef(p, n);
+}
+
+// -------------------------------------------------------------
+bool operator==(const StringRef& a, const StringRef& b)
+{
+	return a.length==b.length && memcmp(a.data, b.data, a.length)==0;
+}
+
+// -------------------------------------------------------------
+bool operator!=(const StringRef& a, const StringRef& b)
+{
+	return !(a==b);
+}
+
+// -------------------------------------------------------------
+bool operator<(const StringRef& a, const StringRef& b)
+{
+	int cmp = memcmp(a.data, b.data, min(a.length, b.length));
+	return cmp<0 || (cmp==0 && a.length<b.length);
+}
+
+// -------------------------------------------------------------
+ostream& operator<<(ostream& out, const StringRef& str)
+{
+	return out.write(str.data, str.length);
+}
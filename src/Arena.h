@@ -0,0 +1,75 @@
+/*
+ *  Arena.h
+ *  craig2kml
+ *
+ *  A bump allocator for the bytes craig2kml extracts from webpages.  Strings
+ *  copied into an Arena stay put until the Arena is destroyed, so records
+ *  can refer to them with a StringRef instead of carrying their own copy.
+ *
+ */
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+using namespace std;
+
+// A string that lives somewhere else, usually in an Arena.  Copying one
+// copies two words.  Strings from an Arena are always NUL terminated.
+struct StringRef {
+	StringRef() : data(""), length(0) {}
+	StringRef(const char* _data, size_t _length) : data(_data), length(_length) {}
+	StringRef(const char* str) : data(str), length(strlen(str)) {}
+	
+	// Only valid as long as the string is not changed or destroyed
+	StringRef(const string& str) : data(str.data()), length(str.length()) {}
+	
+	string str() const { return string(data, length); }
+	bool empty() const { return length==0; }
+	
+	const char* data;
+	size_t length;
+};
+
+bool operator==(const StringRef& a, const StringRef& b);
+bool operator!=(const StringRef& a, const StringRef& b);
+bool operator<(const StringRef& a, const StringRef& b);
+ostream& operator<<(ostream& out, const StringRef& str);
+
+
+class Arena {
+public:
+	
+	Arena(size_t firstBlockSize=4096);
+	~Arena();
+	
+	// Memory that lives as long as the Arena
+	char* alloc(size_t n);
+	
+	// Copy a string into the Arena
+	StringRef copy(const char* str, size_t n);
+	StringRef copy(const char* str) { return copy(str, strlen(str)); }
+	StringRef copy(const StringRef& str) { return copy(str.data, str.length); }
+	StringRef copy(const string& str) { return copy(str.data(), str.length()); }
+	
+	size_t bytesUsed() const { return used; }
+	
+	// Free everything handed out so far.  The next blocks start at the
+	// size the Arena had grown to.
+	void reset();
+	
+protected:
+	
+	vector<char*> blocks;
+	char* current;
+	size_t remaining;
+	size_t blockSize;
+	size_t used;
+	
+private:
+	// Everything handed out points into the blocks, so an Arena can't be copied.
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+};
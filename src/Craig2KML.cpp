@@ -8,34 +8,52 @@
  */
 
 #include "Craig2KML.h"
+#include <sstream>
 
-Craig2KML::Craig2KML(string title, bool verbose) {
+Craig2KML::Craig2KML(const string& title, bool verbose, time_t when) {
 	
 	factory = KmlFactory::GetFactory();
 	kml = factory->CreateKml();
+	balloonTemplate = false;
 	
 	
-	// Create the root folder
+	// Create the root folder.  It is added to the main KML object by serialize().
 	rootFolder = factory->CreateFolder();
 	rootFolder->set_name("Craig2KML");
 	
-	// Add it to the main KML object
-	kml->set_feature(rootFolder);  // kml takes ownership.
-	
 	// Create the description for the main folder
-	time_t t = time(0); //obtain the current time_t value
+	time_t t = when ? when : time(0); //obtain the current time_t value
 	tm now=*localtime(&t); //convert it to tm
 	char tmdescr[255]={0};
 	strftime(tmdescr, sizeof(tmdescr)-1, "%A, %B %d %Y. %X", &now);
-	char desc[1024];
-	sprintf(desc, "\"%s\" on %s", title.c_str(), tmdescr);
+	// The title can be anything (a store's path, say), so no fixed buffer
+	string desc = "\"" + title + "\" on " + tmdescr;
 	if(verbose) cerr << desc << endl;
 	rootFolder->set_description(desc);
 }
 
+void Craig2KML::setBalloonTemplate(bool enabled)
+{
+	balloonTemplate = enabled;
+}
+
 string Craig2KML::serialize()
 {
-	int total = mappablePlacemarks.size() + unmappablePlacemarks.size();
+	// A shared style has to live in a Document, so then the root folder goes in one.
+	if(balloonTemplate)
+	{
+		DocumentPtr document = factory->CreateDocument();
+		document->set_name("Craig2KML");
+		shareBoilerplate(document);
+		document->add_feature(rootFolder);
+		kml->set_feature(document);  // kml takes ownership.
+	}
+	else
+	{
+		kml->set_feature(rootFolder);  // kml takes ownership.
+	}
+	
+	int total = mappablePlacemarks.size() + unmappablePlacemarks.size() + unprocessedPlacemarks.size();
 	char name[255];
 	
 	
@@ -72,16 +90,38 @@ string Craig2KML::serialize()
 		mappableListings->add_feature(mappablePlacemarks[i]);	
 	}
 	
+	// Only there when a deadline cut the run short or a download failed.
+	if(!unprocessedPlacemarks.empty())
+	{
+		FolderPtr unprocessedListings = factory->CreateFolder();
+		sprintf(name, "Unprocessed Listings (%d/%d)", (int)unprocessedPlacemarks.size(), total);
+		unprocessedListings->set_name(name);
+		rootFolder->add_feature(unprocessedListings);  // kml takes ownership.
+		
+		for(int i=0; i<unprocessedPlacemarks.size(); i++)
+		{
+			CoordinatesPtr coordinates = factory->CreateCoordinates();
+			coordinates->add_latlng(mid_lat, mid_lon);
+			
+			PointPtr point = factory->CreatePoint();
+			point->set_coordinates(coordinates);
+			
+			unprocessedPlacemarks[i]->set_geometry(point);
+			
+			unprocessedListings->add_feature( unprocessedPlacemarks[i] );
+		}
+	}
+	
 	return SerializePretty(kml);	
 }
 
-void Craig2KML::addMappable(string title, string description, float lat, float lng)
+void Craig2KML::addMappable(const StringRef& title, const StringRef& description, float lat, float lng)
 {
 	bbox.ExpandLatLon(lat, lng);
 	
 	PlacemarkPtr placemark = factory->CreatePlacemark();
-	placemark->set_name(title);
-	placemark->set_description(description);
+	placemark->set_name(text.assign(title.data, title.length));
+	placemark->set_description(text.assign(description.data, description.length));
 	
 	CoordinatesPtr coordinates = factory->CreateCoordinates();
 	coordinates->add_latlng(lat, lng);
@@ -95,11 +135,103 @@ void Craig2KML::addMappable(string title, string description, float lat, float l
 	
 }
 
-void Craig2KML::addUnmappable(string title, string description)
+void Craig2KML::addUnmappable(const StringRef& title, const StringRef& description)
 {
 	PlacemarkPtr placemark = factory->CreatePlacemark();
-	placemark->set_name(title);
-	placemark->set_description(description);
+	placemark->set_name(text.assign(title.data, title.length));
+	placemark->set_description(text.assign(description.data, description.length));
 	
 	unmappablePlacemarks.push_back(placemark);
+}
+
+void Craig2KML::addUnprocessed(const StringRef& title, const StringRef& url)
+{
+	PlacemarkPtr placemark = factory->CreatePlacemark();
+	placemark->set_name(text.assign(title.data, title.length));
+	text.assign("Not processed. <a href=\"");
+	text.append(url.data, url.length);
+	text.append("\">View the listing</a>");
+	placemark->set_description(text);
+	
+	unprocessedPlacemarks.push_back(placemark);
+}
+
+void Craig2KML::shareBoilerplate(DocumentPtr document)
+{
+	vector<PlacemarkPtr> described;
+	described.insert(described.end(), mappablePlacemarks.begin(), mappablePlacemarks.end());
+	described.insert(described.end(), unmappablePlacemarks.begin(), unmappablePlacemarks.end());
+	if(described.size() < 2) return;
+	
+	vector< vector<string> > lines(described.size());
+	size_t shortest = string::npos;
+	for(size_t i=0; i<described.size(); i++)
+	{
+		istringstream ss(described[i]->get_description());
+		string line;
+		while(getline(ss, line))
+			lines[i].push_back(line);
+		shortest = min(shortest, lines[i].size());
+	}
+	
+	// Only the lines every description starts with, and the lines every
+	// one ends with, can go in the template: that way they stay where
+	// they were, before and after what is left of the description.
+	size_t leading = 0;
+	while(leading < shortest)
+	{
+		size_t i=1;
+		while(i<lines.size() && lines[i][leading]==lines[0][leading]) i++;
+		if(i<lines.size()) break;
+		leading++;
+	}
+	size_t trailing = 0;
+	while(leading+trailing < shortest)
+	{
+		size_t i=1;
+		const string& line = lines[0][lines[0].size()-1-trailing];
+		while(i<lines.size() && lines[i][lines[i].size()-1-trailing]==line) i++;
+		if(i<lines.size()) break;
+		trailing++;
+	}
+	
+	string header, footer;
+	for(size_t l=0; l<leading; l++)
+		header += lines[0][l] + "\n";
+	for(size_t l=lines[0].size()-trailing; l<lines[0].size(); l++)
+		footer += "\n" + lines[0][l];
+	
+	// Each placemark pays for a styleUrl, so it has to be worth it.
+	if(header.length() + footer.length() < 64) return;
+	
+	StylePtr style = factory->CreateStyle();
+	style->set_id("listing");
+	BalloonStylePtr balloon = factory->CreateBalloonStyle();
+	balloon->set_text("<h3>$[name]</h3>\n" + header + "$[description]" + footer);
+	style->set_balloonstyle(balloon);
+	document->add_styleselector(style);
+	
+	for(size_t i=0; i<described.size(); i++)
+	{
+		string description;
+		for(size_t l=leading; l+trailing<lines[i].size(); l++)
+			description += (description.empty() ? "" : "\n") + lines[i][l];
+		described[i]->set_description(description);
+		described[i]->set_styleurl("#listing");
+	}
+}
+
+void Craig2KML::add(const Listing& listing)
+{
+	switch(listing.status)
+	{
+		case Listing::MAPPABLE:
+			addMappable(listing.title, listing.description, listing.lat, listing.lng);
+			break;
+		case Listing::UNMAPPABLE:
+			addUnmappable(listing.title, listing.description);
+			break;
+		default:
+			addUnprocessed(listing.title, listing.url);
+	}
 }
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <kml/dom.h>
 #include <kml/engine.h>
+#include "Listing.h"
 
 using kmldom::CoordinatesPtr;
 using kmldom::KmlPtr;
@@ -18,23 +19,45 @@ using kmldom::KmlFactory;
 using kmldom::PlacemarkPtr;
 using kmldom::PointPtr;
 using kmldom::FolderPtr;
+using kmldom::DocumentPtr;
+using kmldom::StylePtr;
+using kmldom::BalloonStylePtr;
 using kmlengine::Bbox;
 using namespace std;
 
 class Craig2KML {
 public:
 
-	Craig2KML(string title, bool verbose);
+	// 'when' is the time the listings were fetched.  0 means now.
+	Craig2KML(const string& title, bool verbose, time_t when=0);
 	string serialize();
-	void addMappable(string title, string description, float lat, float lng);
-	void addUnmappable(string title, string description);
+	// The strings are copied straight into the placemark, so they can come
+	// from an Arena (or a mapped store) without making a std::string first.
+	void addMappable(const StringRef& title, const StringRef& description, float lat, float lng);
+	void addUnmappable(const StringRef& title, const StringRef& description);
+	
+	// A listing we ran out of time for, or couldn't download.  It just gets a link.
+	void addUnprocessed(const StringRef& title, const StringRef& url);
+	
+	// Calls one of the above, depending on the listing's status
+	void add(const Listing& listing);
+	
+	// Move the lines that every description starts or ends with into a
+	// shared BalloonStyle, instead of repeating them in every placemark.  Only
+	// safe when each line of a description is complete on its own, which
+	// Description makes sure of for everything but "full".
+	void setBalloonTemplate(bool enabled);
 	
 protected:	
+	void shareBoilerplate(DocumentPtr document);
+	bool balloonTemplate;
 	KmlFactory* factory;
 	KmlPtr kml;
 	FolderPtr rootFolder;
 	vector<PlacemarkPtr> mappablePlacemarks;
 	vector<PlacemarkPtr> unmappablePlacemarks;
+	vector<PlacemarkPtr> unprocessedPlacemarks;
+	string text;	// reused to hand strings to libkml
 	Bbox bbox;
 	
 };
\ No newline at end of file
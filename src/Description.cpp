@@ -0,0 +1,317 @@
+/*
+ *  Description.cpp
+ *  craig2kml
+ *
+ */
+
+#include "Description.h"
+#include <cstring>
+#include <algorithm>
+
+// Left out, along with everything inside them
+static const char* skippedTags[] = { "script", "style", "noscript", "img", "iframe", "object", "embed",
+	"form", "input", "select", "textarea", "button", "map", "video", "audio", "head", "title", NULL };
+
+// Kept in HTML mode.  Anything else is replaced by its contents.
+static const char* formattingTags[] = { "p", "b", "strong", "i", "em", "u", "ul", "ol", "li", "blockquote", NULL };
+
+// Start on a new line
+static const char* blockTags[] = { "p", "div", "li", "ul", "ol", "blockquote", "table", "tr", "hr",
+	"h1", "h2", "h3", "h4", "h5", "h6", "pre", "center", "dl", "dt", "dd", NULL };
+
+static const char ellipsis[] = "...";
+
+static bool is_one_of(const xmlChar* name, const char** list)
+{
+	for(int i=0; list[i]; i++)
+		if(strcasecmp((const char*)name, list[i]) == 0)
+			return true;
+	return false;
+}
+
+static string escape(const string& str)
+{
+	string out;
+	for(size_t i=0; i<str.length(); i++)
+	{
+		switch(str[i])
+		{
+			case '&':	out += "&amp;"; break;
+			case '<':	out += "&lt;"; break;
+			case '>':	out += "&gt;"; break;
+			case '"':	out += "&quot;"; break;
+			default:	out += str[i];
+		}
+	}
+	return out;
+}
+
+
+// -------------------------------------------------------------
+Description::Description()
+{
+	mode = HTML;
+	maxBytes = 2000;
+	summaryBytes = 200;
+}
+
+
+// -------------------------------------------------------------
+bool Description::setMode(const string& name)
+{
+	if(name == "full")			mode = FULL;
+	else if(name == "html")		mode = HTML;
+	else if(name == "text")		mode = TEXT;
+	else if(name == "summary")	mode = SUMMARY;
+	else return false;
+	return true;
+}
+
+
+// -------------------------------------------------------------
+string Description::render(xmlNodePtr node, const string& url) const
+{
+	Output out;
+	out.limit = maxBytes>0 ? maxBytes : string::npos;
+	out.reserved = sizeof(ellipsis)-1;
+	out.full = false;
+	out.space = false;
+	out.html = (mode == HTML);
+	out.depth = 0;
+
+	// The summary gets whatever room the link leaves.  If the link doesn't
+	// fit under maxBytes at all, it is left out.
+	string link;
+	if(mode == SUMMARY)
+	{
+		link = " <a href=\"" + escape(url) + "\">View the listing</a>";
+		if(maxBytes>0 && link.length()+out.reserved > maxBytes)
+			link.clear();
+		out.limit = summaryBytes;
+		if(maxBytes>0)
+			out.limit = min(out.limit, maxBytes-link.length());
+	}
+
+	if(node)
+		renderChildren(node, out);
+
+	// No trailing line breaks
+	while(true)
+	{
+		size_t n = out.str.length();
+		if(n >= 1 && out.str[n-1] == '\n')
+			out.str.erase(n-1);
+		else if(n >= 5 && out.str.compare(n-5, 5, "<br/>") == 0)
+			out.str.erase(n-5);
+		else
+			break;
+	}
+	return out.str + link;
+}
+
+
+// -------------------------------------------------------------
+void Description::renderChildren(xmlNodePtr node, Output& out) const
+{
+	for(xmlNodePtr child = node->children; child && !out.full; child = child->next)
+	{
+		renderNode(child, out);
+	}
+}
+
+
+// -------------------------------------------------------------
+void Description::renderNode(xmlNodePtr node, Output& out) const
+{
+	if(node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE)
+	{
+		appendText(out, (const char*)node->content);
+		return;
+	}
+	if(node->type != XML_ELEMENT_NODE || is_one_of(node->name, skippedTags))
+	{
+		return;
+	}
+
+	if(strcasecmp((const char*)node->name, "br") == 0)
+	{
+		lineBreak(out, "<br/>");
+		return;
+	}
+
+	bool block = is_one_of(node->name, blockTags);
+
+	// Which tag, if any, to keep
+	string open, close;
+	if(out.html && is_one_of(node->name, formattingTags))
+	{
+		open = "<" + string((const char*)node->name) + ">";
+		close = "</" + string((const char*)node->name) + ">";
+	}
+	else if(out.html && strcasecmp((const char*)node->name, "a") == 0)
+	{
+		xmlChar* href = xmlGetProp(node, (const xmlChar*)"href");
+		if(href && (strncmp((const char*)href, "http://", 7) == 0 || strncmp((const char*)href, "https://", 8) == 0 || strncmp((const char*)href, "mailto:", 7) == 0))
+		{
+			open = "<a href=\"" + escape((const char*)href) + "\">";
+			close = "</a>";
+		}
+		if(href) xmlFree(href);
+	}
+
+	if(block)
+	{
+		lineBreak(out, open.empty() ? "<br/>" : NULL);
+	}
+
+	if(open.empty())
+	{
+		renderChildren(node, out);
+	}
+	else
+	{
+		if(out.space)
+		{
+			append(out, " ");
+			out.space = false;
+		}
+		size_t start = out.str.length();
+		if(!append(out, open, close.length()))
+			return;
+
+		out.depth++;
+		renderChildren(node, out);
+		out.depth--;
+		out.reserved -= close.length();
+
+		// Nothing survived inside it, so leave the tag out too.
+		if(out.str.length() == start+open.length())
+			out.str.erase(start);
+		else
+			out.str += close;
+	}
+
+	if(block)
+	{
+		lineBreak(out, open.empty() ? "<br/>" : NULL);
+	}
+}
+
+
+// -------------------------------------------------------------
+// Add some markup if there is room for it and for 'closing' more bytes
+// later.  Once something doesn't fit, the description is finished.
+bool Description::append(Output& out, const string& markup, size_t closing) const
+{
+	if(out.full)
+		return false;
+
+	if(out.limit != string::npos && out.str.length()+markup.length()+out.reserved+closing > out.limit)
+	{
+		out.full = true;
+
+		// Don't leave half a word
+		size_t space = out.str.find_last_of(" \n");
+		size_t tag = out.str.find_last_of('>');
+		if(space != string::npos && (tag == string::npos || space > tag) && out.str.length()-space < 20)
+			out.str.erase(space);
+		out.str += ellipsis;
+		return false;
+	}
+
+	out.str += markup;
+	out.reserved += closing;
+	return true;
+}
+
+
+// -------------------------------------------------------------
+// Whitespace is collapsed.  Characters are never split, and the HTML
+// special characters are escaped (the text is still shown as HTML).
+void Description::appendText(Output& out, const char* text) const
+{
+	const unsigned char* p = (const unsigned char*)text;
+	while(p && *p && !out.full)
+	{
+		if(isspace(*p))
+		{
+			if(!out.str.empty() && out.str[out.str.length()-1] != '\n')
+				out.space = true;
+			p++;
+			continue;
+		}
+
+		size_t n = 1;
+		if(*p >= 0xC0)
+			while(p[n] && (p[n] & 0xC0) == 0x80) n++;
+
+		string ch;
+		switch(*p)
+		{
+			case '&':	ch = "&amp;"; break;
+			case '<':	ch = "&lt;"; break;
+			case '>':	ch = "&gt;"; break;
+			default:	ch.assign((const char*)p, n);
+		}
+		if(out.space)
+			ch = " " + ch;
+
+		if(!append(out, ch))
+			return;
+		out.space = false;
+		p += n;
+	}
+}
+
+
+// -------------------------------------------------------------
+// True if the output already ends a line, in the way the mode shows it.
+static bool at_line_start(const string& str, bool html)
+{
+	static const char* breaks[] = { "<br/>", "<p>", "</p>", "<li>", "</li>", "<ul>", "</ul>",
+		"<ol>", "</ol>", "<blockquote>", "</blockquote>", NULL };
+
+	if(str.empty() || str[str.length()-1] == '\n')
+		return true;
+	if(!html)
+		return false;
+	for(int i=0; breaks[i]; i++)
+	{
+		size_t n = strlen(breaks[i]);
+		if(str.length() >= n && str.compare(str.length()-n, n, breaks[i]) == 0)
+			return true;
+	}
+	return false;
+}
+
+
+// -------------------------------------------------------------
+// Start a new line.  Text gets a newline and summaries a space.  HTML gets
+// 'markup' (for tags that were left out), and a newline too if we aren't
+// inside a tag that was kept.  Lines are what Craig2KML compares when it
+// looks for boilerplate, so each one has to be complete HTML.
+void Description::lineBreak(Output& out, const char* markup) const
+{
+	out.space = false;
+	if(mode == SUMMARY)
+	{
+		if(!out.str.empty())
+			out.space = true;
+		return;
+	}
+
+	if(!out.html)
+	{
+		if(!at_line_start(out.str, false))
+			append(out, "\n");
+		return;
+	}
+
+	string br;
+	if(markup && !at_line_start(out.str, true))
+		br = markup;
+	if(out.depth == 0 && !out.str.empty() && out.str[out.str.length()-1] != '\n')
+		br += "\n";
+	if(!br.empty())
+		append(out, br);
+}
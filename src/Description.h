@@ -0,0 +1,61 @@
+/*
+ *  Description.h
+ *  craig2kml
+ *
+ *  Turns the description node of a listing page into what goes in its
+ *  placemark.  The whole formatted node (images, scripts, comments and
+ *  all) is most of the bytes in a KML file, so by default it is cut down
+ *  to a few formatting tags and capped at a number of bytes.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <libxml/tree.h>
+
+using namespace std;
+class Description {
+public:
+
+	enum Mode {
+		FULL,		// the node as it is, formatted.  No cap.
+		HTML,		// text with only simple formatting tags and links
+		TEXT,		// just the text
+		SUMMARY		// the start of the text and a link to the listing, if it fits
+	};
+
+	Description();
+
+	// "full", "html", "text" or "summary".  False if it isn't one of those.
+	bool setMode(const string& name);
+
+	// Everything but FULL.  'url' is the listing, for SUMMARY.
+	string render(xmlNodePtr node, const string& url) const;
+
+	Mode mode;
+
+	// Most bytes a description may take.  0 means no limit.
+	size_t maxBytes;
+
+	// How much of the text a SUMMARY keeps
+	size_t summaryBytes;
+
+protected:
+
+	// The description as it is built, and how much room is left
+	struct Output {
+		string str;
+		size_t limit;
+		size_t reserved;	// for closing tags and the ellipsis
+		bool full;
+		bool space;			// a space is owed before the next word
+		bool html;
+		int depth;			// tags kept and still open
+	};
+
+	void renderChildren(xmlNodePtr node, Output& out) const;
+	void renderNode(xmlNodePtr node, Output& out) const;
+	bool append(Output& out, const string& markup, size_t closing=0) const;
+	void appendText(Output& out, const char* text) const;
+	void lineBreak(Output& out, const char* markup) const;
+};
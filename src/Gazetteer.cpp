@@ -0,0 +1,345 @@
+/*
+ *  Gazetteer.cpp
+ *  craig2kml
+ *
+ */
+
+#include "Gazetteer.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char gazetteerMagic[8] = { 'C','2','K','G','A','Z','1','\0' };
+
+// What a street name ends with, once normalized
+static set<string> make_street_types()
+{
+	const char* types[] = { "st", "ave", "rd", "blvd", "pl", "dr", "ln", "ct", "pkwy", "ter", "hwy", "sq", "way", NULL };
+	set<string> streetTypes;
+	for(int i=0; types[i]; i++)
+		streetTypes.insert(types[i]);
+	return streetTypes;
+}
+static const set<string> streetTypes = make_street_types();
+
+// -------------------------------------------------------------
+Gazetteer::Gazetteer()
+{
+	data = NULL;
+	length = 0;
+	entries = NULL;
+	count = 0;
+	keys = NULL;
+}
+
+// -------------------------------------------------------------
+Gazetteer::~Gazetteer()
+{
+	if(data) munmap(data, length);
+}
+
+// -------------------------------------------------------------
+bool Gazetteer::open(const string& indexfile)
+{
+	int fd = ::open(indexfile.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		cerr << "ERROR: couldn't open gazetteer " << indexfile << endl;
+		return false;
+	}
+	
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header))
+	{
+		cerr << "ERROR: " << indexfile << " is not a gazetteer" << endl;
+		::close(fd);
+		return false;
+	}
+	
+	void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+	{
+		cerr << "ERROR: couldn't map " << indexfile << endl;
+		return false;
+	}
+	
+	const Header* header = (const Header*)mapped;
+	bool valid = memcmp(header->magic, gazetteerMagic, sizeof(gazetteerMagic)) == 0 &&
+		sizeof(Header) + (uint64_t)header->count*sizeof(Entry) <= (uint64_t)st.st_size;
+	
+	// Every key has to be inside the file, or a damaged index would have
+	// us reading past the end of the mapping.
+	if(valid)
+	{
+		const Entry* e = (const Entry*)((const char*)mapped + sizeof(Header));
+		uint64_t keyBytes = st.st_size - sizeof(Header) - (uint64_t)header->count*sizeof(Entry);
+		for(uint32_t i=0; valid && i<header->count; i++)
+			valid = (uint64_t)e[i].keyOffset + e[i].keyLength <= keyBytes;
+	}
+	if(!valid)
+	{
+		cerr << "ERROR: " << indexfile << " is not a gazetteer" << endl;
+		munmap(mapped, st.st_size);
+		return false;
+	}
+	
+	if(data) munmap(data, length);
+	data = (char*)mapped;
+	length = st.st_size;
+	count = header->count;
+	entries = (const Entry*)(data + sizeof(Header));
+	keys = data + sizeof(Header) + count*sizeof(Entry);
+	return true;
+}
+
+// -------------------------------------------------------------
+bool Gazetteer::lookup(const string& address, float& lat, float& lng)
+{
+	if(!data) return false;
+	
+	vector<string> tokens;
+	istringstream ss(normalize(address));
+	string token;
+	while(ss >> token) tokens.push_back(token);
+	
+	// The country and the zip code never help (the index has neither)
+	if(!tokens.empty() && (tokens.back()=="us" || tokens.back()=="usa"))
+		tokens.pop_back();
+	if(tokens.size() > 2 && tokens.back().find_first_not_of("0123456789") == string::npos)
+		tokens.pop_back();
+	
+	// Words can be dropped from the end when the index spells the region
+	// differently or doesn't have it, but the city always stays: without
+	// it, 123 Main St is in any town that has one.  The street ends at its
+	// type (the first word after the name that is st, ave, ...).  If it
+	// doesn't have one, nothing is dropped.
+	size_t keep = tokens.size();
+	for(size_t i=2; i<tokens.size(); i++)
+	{
+		if(streetTypes.count(tokens[i]))
+		{
+			keep = min(tokens.size(), i+2);
+			break;
+		}
+	}
+	
+	for(size_t n=tokens.size(); n>=keep && n>=2; n--)
+	{
+		string key = tokens[0];
+		for(size_t i=1; i<n; i++) key += " " + tokens[i];
+		if(find(key, lat, lng))
+			return true;
+	}
+	return false;
+}
+
+// -------------------------------------------------------------
+// An exact match, or the one address that starts with key followed by a
+// space.  If several different addresses do, it is a miss.
+bool Gazetteer::find(const string& key, float& lat, float& lng)
+{
+	uint32_t lo = 0, hi = count;
+	while(lo < hi)
+	{
+		uint32_t mid = lo + (hi-lo)/2;
+		const Entry& e = entries[mid];
+		size_t n = min((size_t)e.keyLength, key.length());
+		int cmp = memcmp(keys+e.keyOffset, key.data(), n);
+		if(cmp < 0 || (cmp == 0 && e.keyLength < key.length()))
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	if(lo == count) return false;
+	
+	const Entry& e = entries[lo];
+	if(e.keyLength < key.length() || memcmp(keys+e.keyOffset, key.data(), key.length()) != 0)
+		return false;
+	if(e.keyLength > key.length())
+	{
+		if(keys[e.keyOffset+key.length()] != ' ')
+			return false;
+		
+		// The entries after it that also start with key are all the same
+		// address (several points for one building), or it is ambiguous.
+		for(uint32_t next = lo+1; next < count; next++)
+		{
+			const Entry& other = entries[next];
+			if(other.keyLength < key.length()+1 || memcmp(keys+other.keyOffset, key.data(), key.length()) != 0 ||
+			   keys[other.keyOffset+key.length()] != ' ')
+				break;
+			if(other.keyLength != e.keyLength || memcmp(keys+other.keyOffset, keys+e.keyOffset, e.keyLength) != 0)
+				return false;
+		}
+	}
+	
+	lat = e.lat;
+	lng = e.lng;
+	return true;
+}
+
+// -------------------------------------------------------------
+// Built before main, so lookups from several threads only ever read it.
+static map<string,string> make_abbreviations()
+{
+	map<string,string> abbreviations;
+	abbreviations["street"] = "st";		abbreviations["avenue"] = "ave";
+	abbreviations["av"] = "ave";		abbreviations["road"] = "rd";
+	abbreviations["boulevard"] = "blvd";	abbreviations["place"] = "pl";
+	abbreviations["drive"] = "dr";		abbreviations["lane"] = "ln";
+	abbreviations["court"] = "ct";		abbreviations["parkway"] = "pkwy";
+	abbreviations["terrace"] = "ter";	abbreviations["highway"] = "hwy";
+	abbreviations["square"] = "sq";		abbreviations["north"] = "n";
+	abbreviations["south"] = "s";		abbreviations["east"] = "e";
+	abbreviations["west"] = "w";
+	return abbreviations;
+}
+static const map<string,string> abbreviations = make_abbreviations();
+
+// -------------------------------------------------------------
+string Gazetteer::normalize(const string& address)
+{
+	// Decode the url encoding and keep only letters and digits
+	string clean;
+	for(size_t i=0; i<address.length(); i++)
+	{
+		char c = address[i];
+		if(c == '%' && i+2 < address.length() && isxdigit(address[i+1]) && isxdigit(address[i+2]))
+		{
+			c = (char)strtol(address.substr(i+1, 2).c_str(), NULL, 16);
+			i += 2;
+		}
+		clean += isalnum((unsigned char)c) ? (char)tolower(c) : ' ';
+	}
+	
+	string normalized, word;
+	istringstream ss(clean);
+	while(ss >> word)
+	{
+		map<string,string>::const_iterator it = abbreviations.find(word);
+		if(!normalized.empty()) normalized += " ";
+		normalized += (it == abbreviations.end()) ? word : it->second;
+	}
+	return normalized;
+}
+
+// -------------------------------------------------------------
+bool Gazetteer::build(const string& csvfile, const string& indexfile, bool verbose)
+{
+	ifstream csv(csvfile.c_str());
+	if(!csv.is_open())
+	{
+		cerr << "ERROR: couldn't open " << csvfile << endl;
+		return false;
+	}
+	
+	// Find the columns we need by name
+	string line;
+	getline(csv, line);
+	vector<string> header = splitCSV(line);
+	int lonCol=-1, latCol=-1, numberCol=-1, streetCol=-1, cityCol=-1, regionCol=-1;
+	for(size_t i=0; i<header.size(); i++)
+	{
+		string name = normalize(header[i]);
+		if(name == "lon" || name == "longitude")	lonCol = i;
+		else if(name == "lat" || name == "latitude")	latCol = i;
+		else if(name == "number")	numberCol = i;
+		else if(name == "st" || name == "address")	streetCol = i;
+		else if(name == "city")		cityCol = i;
+		else if(name == "region" || name == "state")	regionCol = i;
+	}
+	if(lonCol < 0 || latCol < 0 || streetCol < 0)
+	{
+		cerr << "ERROR: " << csvfile << " needs LON, LAT and STREET columns" << endl;
+		return false;
+	}
+	
+	// key, lat, lng
+	vector<pair<string, pair<float,float> > > rows;
+	while(getline(csv, line))
+	{
+		vector<string> fields = splitCSV(line);
+		if(fields.size() < header.size()) continue;
+		
+		string address;
+		if(numberCol >= 0)	address += fields[numberCol] + " ";
+		address += fields[streetCol];
+		if(cityCol >= 0)	address += " " + fields[cityCol];
+		if(regionCol >= 0)	address += " " + fields[regionCol];
+		
+		string key = normalize(address);
+		if(key.empty()) continue;
+		rows.push_back(make_pair(key, make_pair((float)atof(fields[latCol].c_str()), (float)atof(fields[lonCol].c_str()))));
+	}
+	
+	sort(rows.begin(), rows.end());
+	
+	// Write the header, the entries, then the keys
+	vector<Entry> index;
+	string blob;
+	for(size_t i=0; i<rows.size(); i++)
+	{
+		if(i > 0 && rows[i].first == rows[i-1].first) continue;
+		Entry e;
+		e.keyOffset = blob.length();
+		e.keyLength = rows[i].first.length();
+		e.lat = rows[i].second.first;
+		e.lng = rows[i].second.second;
+		index.push_back(e);
+		blob += rows[i].first;
+	}
+	
+	Header h;
+	memcpy(h.magic, gazetteerMagic, sizeof(gazetteerMagic));
+	h.count = index.size();
+	h.reserved = 0;
+	
+	ofstream out(indexfile.c_str(), ios::out | ios::binary);
+	if(!out.is_open())
+	{
+		cerr << "ERROR: couldn't write " << indexfile << endl;
+		return false;
+	}
+	out.write((const char*)&h, sizeof(h));
+	if(!index.empty())
+		out.write((const char*)&index[0], index.size()*sizeof(Entry));
+	out.write(blob.data(), blob.length());
+	out.close();
+	
+	if(verbose)
+		cerr << "Wrote " << index.size() << " addresses to " << indexfile << endl;
+	return true;
+}
+
+// -------------------------------------------------------------
+vector<string> Gazetteer::splitCSV(const string& line)
+{
+	vector<string> fields;
+	string field;
+	bool quoted = false;
+	for(size_t i=0; i<line.length(); i++)
+	{
+		char c = line[i];
+		if(quoted)
+		{
+			if(c == '"' && i+1 < line.length() && line[i+1] == '"') { field += '"'; i++; }
+			else if(c == '"') quoted = false;
+			else field += c;
+		}
+		else if(c == '"')	quoted = true;
+		else if(c == ',')	{ fields.push_back(field); field.clear(); }
+		else if(c != '\r')	field += c;
+	}
+	fields.push_back(field);
+	return fields;
+}
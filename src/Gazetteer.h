@@ -0,0 +1,61 @@
+/*
+ *  Gazetteer.h
+ *  craig2kml
+ *
+ *  An offline geocoder.  An address point file (an OpenAddresses style CSV)
+ *  is turned into a sorted index of normalized addresses once, with
+ *  Gazetteer::build.  The index is memory-mapped and searched with a
+ *  binary search, so a lookup costs a few string compares.
+ *
+ */
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+class Gazetteer {
+public:
+	
+	Gazetteer();
+	~Gazetteer();
+	
+	// Turn a CSV with LON, LAT, NUMBER, STREET, CITY and REGION columns into an index file
+	static bool build(const string& csvfile, const string& indexfile, bool verbose=false);
+	
+	// Map an index file made by build()
+	bool open(const string& indexfile);
+	bool isOpen() { return data != NULL; }
+	
+	// Find an address as it appears in a google maps link (url encoded is fine)
+	bool lookup(const string& address, float& lat, float& lng);
+	
+	// Lowercase, no punctuation, single spaces and common abbreviations
+	static string normalize(const string& address);
+	
+protected:
+	
+	// The file is a header, 'count' Entries sorted by key, then the keys.
+	struct Header {
+		char magic[8];
+		uint32_t count;
+		uint32_t reserved;
+	};
+	struct Entry {
+		uint32_t keyOffset;
+		uint32_t keyLength;
+		float lat;
+		float lng;
+	};
+	
+	bool find(const string& key, float& lat, float& lng);
+	static vector<string> splitCSV(const string& line);
+	
+	char* data;
+	size_t length;
+	const Entry* entries;
+	uint32_t count;
+	const char* keys;
+};
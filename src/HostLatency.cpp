@@ -0,0 +1,120 @@
+/*
+ *  HostLatency.cpp
+ *  craig2kml
+ *
+ */
+
+#include "HostLatency.h"
+#include <algorithm>
+
+// -------------------------------------------------------------
+double HostLatency::hedgeFraction = 0;
+long HostLatency::minTimeoutMs = 250;
+long HostLatency::maxTimeoutMs = 15000;
+const size_t HostLatency::window = 100;
+const size_t HostLatency::minSamples = 10;
+const int HostLatency::maxBackoff = 2;
+map<string,HostLatency::Host> HostLatency::hosts;
+unsigned long HostLatency::requests = 0;
+unsigned long HostLatency::hedges = 0;
+pthread_mutex_t HostLatency::mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// -------------------------------------------------------------
+string HostLatency::hostOf(const string& url)
+{
+	size_t start = url.find("://");
+	start = (start == string::npos) ? 0 : start+3;
+	size_t end = url.find_first_of("/?#", start);
+	return url.substr(start, end == string::npos ? string::npos : end-start);
+}
+
+
+// -------------------------------------------------------------
+// Only the last 'window' answers count, so the numbers follow the host
+// as it speeds up or slows down.
+void HostLatency::record(const string& host, double seconds)
+{
+	pthread_mutex_lock(&mutex);
+	Host& h = hosts[host];
+	if(h.backoff > 0)
+		h.backoff--;
+	if(h.samples.size() < window)
+	{
+		h.samples.push_back(seconds);
+	}
+	else
+	{
+		h.samples[h.next] = seconds;
+		h.next = (h.next+1) % window;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+void HostLatency::timedOut(const string& host)
+{
+	pthread_mutex_lock(&mutex);
+	Host& h = hosts[host];
+	h.backoff = min(maxBackoff, h.backoff+1);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+double HostLatency::percentile(const string& host, double p)
+{
+	vector<double> sorted;
+	pthread_mutex_lock(&mutex);
+	map<string,Host>::iterator it = hosts.find(host);
+	if(it != hosts.end())
+		sorted = it->second.samples;
+	pthread_mutex_unlock(&mutex);
+
+	if(sorted.size() < minSamples)
+		return 0;
+
+	size_t n = (size_t)(p * (sorted.size()-1) + 0.5);
+	nth_element(sorted.begin(), sorted.begin()+n, sorted.end());
+	return sorted[n];
+}
+
+
+// -------------------------------------------------------------
+long HostLatency::timeoutMs(const string& host, long fallback)
+{
+	double p99 = percentile(host, 0.99);
+	if(p99 <= 0)
+		return fallback;
+
+	pthread_mutex_lock(&mutex);
+	int backoff = hosts[host].backoff;
+	pthread_mutex_unlock(&mutex);
+
+	long timeout = (long)(p99 * 4 * 1000) << backoff;
+	return max(minTimeoutMs, min(maxTimeoutMs, timeout));
+}
+
+
+// -------------------------------------------------------------
+void HostLatency::started()
+{
+	pthread_mutex_lock(&mutex);
+	requests++;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+bool HostLatency::mayHedge()
+{
+	if(hedgeFraction <= 0)
+		return false;
+
+	pthread_mutex_lock(&mutex);
+	bool allowed = (hedges+1) <= hedgeFraction * (requests+1);
+	if(allowed) hedges++;
+	pthread_mutex_unlock(&mutex);
+	return allowed;
+}
@@ -0,0 +1,71 @@
+/*
+ *  HostLatency.h
+ *  craig2kml
+ *
+ *  Keeps the response times of recent requests to each host, so that
+ *  Webpage::download can give each one a timeout that fits it (the
+ *  geocoder answers in tens of milliseconds, craigslist can take seconds)
+ *  and can tell when a request has become unusually slow and is worth
+ *  sending again (hedging).
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+
+using namespace std;
+class HostLatency {
+public:
+
+	// "host[:port]" from a URL
+	static string hostOf(const string& url);
+
+	// A request to 'host' got its answer after this long
+	static void record(const string& host, double seconds);
+
+	// A request to 'host' ran out its own timeout.  How long it would have
+	// taken isn't known, so it isn't a sample: instead the next timeouts
+	// are doubled, up to maxBackoff times, and each answer halves them again.
+	static void timedOut(const string& host);
+
+	// The pth percentile (0-1) of recent answers from 'host', in seconds.
+	// 0 until there are enough of them to say.
+	static double percentile(const string& host, double p);
+
+	// How long to let a request to 'host' run: a few times the p99 of its
+	// answers, doubled for each step of backoff, within minTimeoutMs and
+	// maxTimeoutMs.  'fallback' until there are enough samples.
+	static long timeoutMs(const string& host, long fallback);
+
+	// Call once for every request that is started, hedges included
+	static void started();
+
+	// True (and counted) if one more hedge keeps hedges under hedgeFraction of all requests
+	static bool mayHedge();
+
+	// At most this fraction of requests may be hedges.  0 turns hedging off.
+	static double hedgeFraction;
+
+	static long minTimeoutMs;
+	static long maxTimeoutMs;
+
+protected:
+
+	struct Host {
+		Host() : next(0), backoff(0) {}
+		vector<double> samples;
+		size_t next;
+		int backoff;
+	};
+
+	static const size_t window;
+	static const size_t minSamples;
+	static const int maxBackoff;
+	static map<string,Host> hosts;
+	static unsigned long requests;
+	static unsigned long hedges;
+	static pthread_mutex_t mutex;
+};
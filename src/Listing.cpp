@@ -0,0 +1,184 @@
+/*
+ *  Listing.cpp
+ *  craig2kml
+ *
+ */
+
+#include "Listing.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <kml/engine.h>
+
+// Fields are tab separated, so tabs, newlines and backslashes are escaped.
+static string escape(const StringRef& str);
+static string unescape(const string& str);
+
+// -------------------------------------------------------------
+Listing::Listing()
+{
+	lat = 0;
+	lng = 0;
+	status = UNPROCESSED;
+	found = 0;
+}
+
+// -------------------------------------------------------------
+Listing::Listing(const StringRef& _title, const StringRef& _url)
+{
+	title = _title;
+	url = _url;
+	id = postingId(url);
+	lat = 0;
+	lng = 0;
+	status = UNPROCESSED;
+	found = 0;
+}
+
+// -------------------------------------------------------------
+StringRef Listing::postingId(const StringRef& url)
+{
+	size_t end = url.length;
+	if(end >= 5 && memcmp(url.data+end-5, ".html", 5) == 0) end -= 5;
+	size_t start = end;
+	while(start > 0 && isdigit(url.data[start-1])) start--;
+	
+	// Not a normal craigslist URL.  The URL itself will do.
+	if(start == end) return url;
+	return StringRef(url.data+start, end-start);
+}
+
+// -------------------------------------------------------------
+int Listing::price(const StringRef& title)
+{
+	for(size_t i=0; i+1<title.length; i++)
+	{
+		if(title.data[i] == '$' && isdigit(title.data[i+1]))
+		{
+			int price = 0;
+			for(i++; i<title.length && isdigit(title.data[i]) && price < 100000000; i++)
+				price = price*10 + (title.data[i]-'0');
+			return price;
+		}
+	}
+	return -1;
+}
+
+// -------------------------------------------------------------
+bool Listing::moreRecent(const Listing* a, const Listing* b)
+{
+	if(a->found != b->found)
+		return a->found > b->found;
+	
+	// Longer IDs are bigger numbers
+	if(a->id.length != b->id.length)
+		return a->id.length > b->id.length;
+	return b->id < a->id;
+}
+
+// -------------------------------------------------------------
+// One pass to find the listings inside, then only the first 'limit' of
+// those are put in order.  A query is never asked twice of the same
+// listings, so building an index first would only cost more.
+vector<const Listing*> Listing::newestInside(const vector<const Listing*>& listings, const kmlengine::Bbox& box, size_t limit)
+{
+	vector<const Listing*> inside;
+	for(size_t i=0; i<listings.size(); i++)
+	{
+		const Listing* listing = listings[i];
+		if(listing->status == MAPPABLE && box.Contains(listing->lat, listing->lng))
+			inside.push_back(listing);
+	}
+	
+	if(limit>0 && inside.size()>limit)
+	{
+		partial_sort(inside.begin(), inside.begin()+limit, inside.end(), moreRecent);
+		inside.resize(limit);
+	}
+	else
+	{
+		sort(inside.begin(), inside.end(), moreRecent);
+	}
+	return inside;
+}
+
+// -------------------------------------------------------------
+string Listing::serialize() const
+{
+	char coords[64], when[32];
+	// %.9g reads back as exactly the same float
+	sprintf(coords, "%d\t%.9g\t%.9g", (int)status, lat, lng);
+	sprintf(when, "%ld", (long)found);
+	return escape(id) + "\t" + coords + "\t" + escape(title) + "\t" + escape(url) + "\t" + escape(description) + "\t" + when;
+}
+
+// -------------------------------------------------------------
+bool Listing::unserialize(const string& line, Arena& arena)
+{
+	vector<string> fields;
+	size_t start = 0;
+	while(true)
+	{
+		size_t tab = line.find('\t', start);
+		fields.push_back(line.substr(start, tab==string::npos ? string::npos : tab-start));
+		if(tab == string::npos) break;
+		start = tab+1;
+	}
+	// State files from before 'found' have one field less
+	if(fields.size() != 7 && fields.size() != 8) return false;
+	
+	id			= arena.copy(unescape(fields[0]));
+	status		= (Status)atoi(fields[1].c_str());
+	lat			= atof(fields[2].c_str());
+	lng			= atof(fields[3].c_str());
+	title		= arena.copy(unescape(fields[4]));
+	url			= arena.copy(unescape(fields[5]));
+	description	= arena.copy(unescape(fields[6]));
+	found		= fields.size() > 7 ? (time_t)atol(fields[7].c_str()) : 0;
+	return true;
+}
+
+// -------------------------------------------------------------
+static string escape(const StringRef& str)
+{
+	string out;
+	out.reserve(str.length);
+	for(size_t i=0; i<str.length; i++)
+	{
+		switch(str.data[i])
+		{
+			case '\\':	out += "\\\\"; break;
+			case '\t':	out += "\\t"; break;
+			case '\n':	out += "\\n"; break;
+			case '\r':	out += "\\r"; break;
+			default:	out += str.data[i];
+		}
+	}
+	return out;
+}
+
+// -------------------------------------------------------------
+static string unescape(const string& str)
+{
+	string out;
+	out.reserve(str.length());
+	for(size_t i=0; i<str.length(); i++)
+	{
+		if(str[i] != '\\' || i+1 == str.length())
+		{
+			out += str[i];
+			continue;
+		}
+		switch(str[++i])
+		{
+			case 't':	out += '\t'; break;
+			case 'n':	out += '\n'; break;
+			case 'r':	out += '\r'; break;
+			default:	out += str[i];
+		}
+	}
+	return out;
+}
@@ -0,0 +1,59 @@
+/*
+ *  Listing.h
+ *  craig2kml
+ *
+ *  Everything craig2kml extracts from one craigslist posting.  The strings
+ *  live in an Arena, so a Listing is cheap to copy and hand around.
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <ctime>
+#include "Arena.h"
+
+namespace kmlengine { class Bbox; }
+using namespace std;
+
+struct Listing {
+	
+	enum Status {
+		UNPROCESSED,	// not done: out of time, or a download or geocode failed.  Tried again next time.
+		MAPPABLE,
+		UNMAPPABLE		// done, but there is no address or the geocoder can't find it
+	};
+	
+	Listing();
+	Listing(const StringRef& title, const StringRef& url);
+	
+	// One line of text, used for state files.  The strings read back are copied into 'arena'.
+	string serialize() const;
+	bool unserialize(const string& line, Arena& arena);
+	
+	// The posting ID is the number at the end of the listing URL.
+	static StringRef postingId(const StringRef& url);
+	
+	// The asking price, from a title like "$1850 / 1br - ...".  -1 if there isn't one.
+	static int price(const StringRef& title);
+	
+	// Newer listings were found later.  Listings found by the same crawl
+	// go by posting ID, which craigslist hands out in order.
+	static bool moreRecent(const Listing* a, const Listing* b);
+	
+	// The mappable listings inside 'box', most recent first.  At most
+	// 'limit' of them, unless 'limit' is 0.  Boxes don't wrap around the
+	// antimeridian; craigslist areas never cross it.
+	static vector<const Listing*> newestInside(const vector<const Listing*>& listings, const kmlengine::Bbox& box, size_t limit=0);
+	
+	StringRef id;
+	StringRef title;
+	StringRef url;
+	StringRef description;
+	float lat;
+	float lng;
+	Status status;
+	
+	// When the crawl that processed it fetched the search page.  0 if we don't know.
+	time_t found;
+};
@@ -0,0 +1,362 @@
+/*
+ *  ListingStore.cpp
+ *  craig2kml
+ *
+ */
+
+#include "ListingStore.h"
+#include <set>
+#include <cstring>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+static const char blockMagic[8] = { 'C','2','K','B','L','K','1','\0' };
+
+static size_t padded(size_t n) { return (n+7) & ~(size_t)7; }
+
+// 'lower' is already lowercase
+static bool contains(const StringRef& text, const string& lower)
+{
+	if(lower.empty()) return true;
+	for(size_t i=0; i+lower.length()<=text.length; i++)
+	{
+		size_t j=0;
+		while(j<lower.length() && tolower((unsigned char)text.data[i+j]) == lower[j]) j++;
+		if(j == lower.length()) return true;
+	}
+	return false;
+}
+
+// -------------------------------------------------------------
+ListingStore::Filter::Filter()
+{
+	since = 0;
+	until = 0;
+	areaSet = false;
+	minPrice = 0;
+	maxPrice = 0;
+}
+
+// -------------------------------------------------------------
+ListingStore::ListingStore()
+{
+	data = NULL;
+	length = 0;
+	rows = 0;
+}
+
+// -------------------------------------------------------------
+ListingStore::~ListingStore()
+{
+	if(data) munmap(data, length);
+}
+
+// -------------------------------------------------------------
+ListingStore::Layout ListingStore::layout(uint32_t count, uint32_t stringBytes)
+{
+	Layout l;
+	size_t at = sizeof(BlockHeader);
+	l.found = at;		at += padded(count*sizeof(int64_t));
+	l.lat = at;			at += padded(count*sizeof(float));
+	l.lng = at;			at += padded(count*sizeof(float));
+	l.price = at;		at += padded(count*sizeof(int32_t));
+	l.status = at;		at += padded(count*sizeof(uint8_t));
+	l.id = at;			at += padded(count*sizeof(Span));
+	l.title = at;		at += padded(count*sizeof(Span));
+	l.url = at;			at += padded(count*sizeof(Span));
+	l.description = at;	at += padded(count*sizeof(Span));
+	l.strings = at;		at += padded(stringBytes);
+	l.size = at;
+	return l;
+}
+
+// -------------------------------------------------------------
+bool ListingStore::append(const string& storefile, const vector<const Listing*>& listings)
+{
+	if(listings.empty())
+		return true;
+
+	// The strings first, so we know how big the block is
+	uint32_t count = listings.size();
+	string strings;
+	vector<Span> spans(count*4);
+	for(uint32_t i=0; i<count; i++)
+	{
+		const Listing& listing = *listings[i];
+		const StringRef* fields[4] = { &listing.id, &listing.title, &listing.url, &listing.description };
+		for(int f=0; f<4; f++)
+		{
+			spans[f*count+i].offset = strings.length();
+			spans[f*count+i].length = fields[f]->length;
+			strings.append(fields[f]->data, fields[f]->length);
+		}
+	}
+
+	Layout l = layout(count, strings.length());
+	vector<char> block(l.size, 0);
+	BlockHeader header;
+	memcpy(header.magic, blockMagic, sizeof(blockMagic));
+	header.count = count;
+	header.stringBytes = strings.length();
+	memcpy(&block[0], &header, sizeof(header));
+
+	for(uint32_t i=0; i<count; i++)
+	{
+		const Listing& listing = *listings[i];
+		int64_t found = listing.found;
+		int32_t price = Listing::price(listing.title);
+		uint8_t status = listing.status;
+		memcpy(&block[l.found + i*sizeof(found)], &found, sizeof(found));
+		memcpy(&block[l.lat + i*sizeof(float)], &listing.lat, sizeof(float));
+		memcpy(&block[l.lng + i*sizeof(float)], &listing.lng, sizeof(float));
+		memcpy(&block[l.price + i*sizeof(price)], &price, sizeof(price));
+		memcpy(&block[l.status + i], &status, sizeof(status));
+	}
+	memcpy(&block[l.id], &spans[0], count*sizeof(Span));
+	memcpy(&block[l.title], &spans[count], count*sizeof(Span));
+	memcpy(&block[l.url], &spans[count*2], count*sizeof(Span));
+	memcpy(&block[l.description], &spans[count*3], count*sizeof(Span));
+	memcpy(&block[l.strings], strings.data(), strings.length());
+
+	int fd = ::open(storefile.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+	if(fd < 0)
+	{
+		cerr << "ERROR: couldn't open store " << storefile << endl;
+		return false;
+	}
+
+	// Other processes (shards) may be appending too.  A block a crash
+	// left half written is cut off first, or readers would stop there and
+	// never see this one.  Anything else that isn't a block is left alone.
+	if(flock(fd, LOCK_EX) != 0)
+	{
+		cerr << "ERROR: couldn't lock store " << storefile << endl;
+		::close(fd);
+		return false;
+	}
+	struct stat st;
+	off_t valid = 0;
+	bool ok = (fstat(fd, &st) == 0);
+	if(ok && !validLength(fd, valid))
+	{
+		cerr << "ERROR: " << storefile << " is not a listing store, or is damaged.  Not appending to it." << endl;
+		flock(fd, LOCK_UN);
+		::close(fd);
+		return false;
+	}
+	if(ok && valid != st.st_size)
+		ok = (ftruncate(fd, valid) == 0);
+
+	size_t written = 0;
+	while(ok && written < block.size())
+	{
+		ssize_t n = ::write(fd, &block[written], block.size()-written);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) ok = false;
+		else written += n;
+	}
+	flock(fd, LOCK_UN);
+	::close(fd);
+
+	if(!ok)
+		cerr << "ERROR: couldn't append to store " << storefile << endl;
+	return ok;
+}
+
+// -------------------------------------------------------------
+// A block is torn if it has a header and runs past the end of the file,
+// or if the file ends partway through the header.
+ListingStore::BlockState ListingStore::blockState(const char* bytes, size_t available, size_t& blockSize)
+{
+	if(available < sizeof(BlockHeader))
+		return memcmp(bytes, blockMagic, min(available, sizeof(blockMagic))) == 0 ? TORN : DAMAGED;
+
+	const BlockHeader* header = (const BlockHeader*)bytes;
+	if(memcmp(header->magic, blockMagic, sizeof(blockMagic)) != 0)
+		return DAMAGED;
+	blockSize = layout(header->count, header->stringBytes).size;
+	return blockSize > available ? TORN : WHOLE;
+}
+
+// -------------------------------------------------------------
+bool ListingStore::validLength(int fd, off_t& valid)
+{
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+		return false;
+
+	valid = 0;
+	while(valid < st.st_size)
+	{
+		char header[sizeof(BlockHeader)];
+		size_t available = st.st_size - valid;
+		size_t wanted = min(available, sizeof(header));
+		if(pread(fd, header, wanted, valid) != (ssize_t)wanted)
+			return false;
+
+		size_t size = 0;
+		BlockState state = blockState(header, available, size);
+		if(state == DAMAGED)
+			return false;
+		if(state == TORN)
+			return true;
+		valid += size;
+	}
+	return true;
+}
+
+// -------------------------------------------------------------
+bool ListingStore::open(const string& storefile)
+{
+	int fd = ::open(storefile.c_str(), O_RDONLY);
+	if(fd < 0)
+	{
+		cerr << "ERROR: couldn't open store " << storefile << endl;
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		cerr << "ERROR: store " << storefile << " is empty" << endl;
+		::close(fd);
+		return false;
+	}
+
+	void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(mapped == MAP_FAILED)
+	{
+		cerr << "ERROR: couldn't map " << storefile << endl;
+		return false;
+	}
+
+	// Find the blocks, and make sure every string of every listing is
+	// inside its block, so a damaged store can't have us reading past the
+	// end of the mapping.
+	vector<Block> found;
+	size_t count = 0;
+	size_t at = 0;
+	bool damaged = false;
+	while(at < (size_t)st.st_size && !damaged)
+	{
+		size_t size = 0;
+		BlockState state = blockState((const char*)mapped + at, st.st_size - at, size);
+		if(state == TORN)
+			break;
+		damaged = (state == DAMAGED);
+		if(damaged)
+			break;
+
+		const BlockHeader* header = (const BlockHeader*)((const char*)mapped + at);
+		Block block;
+		block.base = (const char*)mapped + at;
+		block.count = header->count;
+		block.layout = layout(header->count, header->stringBytes);
+
+		size_t columns[4] = { block.layout.id, block.layout.title, block.layout.url, block.layout.description };
+		for(int c=0; c<4 && !damaged; c++)
+		{
+			const Span* spans = (const Span*)(block.base + columns[c]);
+			for(uint32_t i=0; i<block.count && !damaged; i++)
+				damaged = spans[i].offset > header->stringBytes || spans[i].length > header->stringBytes - spans[i].offset;
+		}
+		if(damaged)
+			break;
+
+		found.push_back(block);
+		count += block.count;
+		at += size;
+	}
+
+	if(damaged || found.empty())
+	{
+		if(damaged && at > 0)
+			cerr << "ERROR: " << storefile << " is damaged at byte " << at << endl;
+		else
+			cerr << "ERROR: " << storefile << " is not a listing store" << endl;
+		munmap(mapped, st.st_size);
+		return false;
+	}
+
+	if(data) munmap(data, length);
+	data = (char*)mapped;
+	length = st.st_size;
+	blocks = found;
+	rows = count;
+	return true;
+}
+
+// -------------------------------------------------------------
+// Newest first, and only the first copy of each listing is looked at, so
+// an older copy can't pass when the newest one doesn't.  After the ID,
+// the cheap columns are checked first, so most listings are turned down
+// without reading the rest of their strings.
+vector<Listing> ListingStore::select(const Filter& filter) const
+{
+	string keyword;
+	for(size_t i=0; i<filter.keyword.length(); i++)
+		keyword += tolower((unsigned char)filter.keyword[i]);
+
+	vector<Listing> selected;
+	set<StringRef> ids;
+	for(size_t b=blocks.size(); b-- > 0; )
+	{
+		const Block& block = blocks[b];
+		const int64_t* found = (const int64_t*)(block.base + block.layout.found);
+		const float* lat = (const float*)(block.base + block.layout.lat);
+		const float* lng = (const float*)(block.base + block.layout.lng);
+		const int32_t* price = (const int32_t*)(block.base + block.layout.price);
+		const uint8_t* status = (const uint8_t*)(block.base + block.layout.status);
+		const Span* id = (const Span*)(block.base + block.layout.id);
+		const char* strings = block.base + block.layout.strings;
+
+		for(uint32_t i=block.count; i-- > 0; )
+		{
+			if(!ids.insert(StringRef(strings + id[i].offset, id[i].length)).second)
+				continue;
+			if(filter.since>0 && found[i] < filter.since)
+				continue;
+			if(filter.until>0 && found[i] >= filter.until)
+				continue;
+			if(filter.areaSet && (status[i] != Listing::MAPPABLE || !filter.area.Contains(lat[i], lng[i])))
+				continue;
+			if((filter.minPrice>0 || filter.maxPrice>0) && (price[i] < 0 || price[i] < filter.minPrice ||
+			   (filter.maxPrice>0 && price[i] > filter.maxPrice)))
+				continue;
+
+			Listing listing = row(block, i);
+			if(!keyword.empty() && !contains(listing.title, keyword) && !contains(listing.description, keyword))
+				continue;
+			selected.push_back(listing);
+		}
+	}
+	return selected;
+}
+
+// -------------------------------------------------------------
+Listing ListingStore::row(const Block& block, uint32_t i) const
+{
+	const Span* id = (const Span*)(block.base + block.layout.id);
+	const Span* title = (const Span*)(block.base + block.layout.title);
+	const Span* url = (const Span*)(block.base + block.layout.url);
+	const Span* description = (const Span*)(block.base + block.layout.description);
+	const char* strings = block.base + block.layout.strings;
+
+	Listing listing;
+	listing.id = StringRef(strings + id[i].offset, id[i].length);
+	listing.title = StringRef(strings + title[i].offset, title[i].length);
+	listing.url = StringRef(strings + url[i].offset, url[i].length);
+	listing.description = StringRef(strings + description[i].offset, description[i].length);
+	listing.lat = ((const float*)(block.base + block.layout.lat))[i];
+	listing.lng = ((const float*)(block.base + block.layout.lng))[i];
+	listing.status = (Listing::Status)((const uint8_t*)(block.base + block.layout.status))[i];
+	listing.found = ((const int64_t*)(block.base + block.layout.found))[i];
+	return listing;
+}
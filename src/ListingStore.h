@@ -0,0 +1,112 @@
+/*
+ *  ListingStore.h
+ *  craig2kml
+ *
+ *  Every listing craig2kml has extracted, kept so that it can be asked
+ *  about again without crawling.  The file only ever grows: each crawl
+ *  appends one block, and a block keeps each field of its listings
+ *  together in one array, so a query reads the times or coordinates of
+ *  a whole block without touching the strings.  The file is
+ *  memory-mapped for reading, and the listings that come out of it point
+ *  straight into the mapping.
+ *
+ */
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+#include <kml/engine.h>
+#include "Listing.h"
+
+using kmlengine::Bbox;
+using namespace std;
+
+class ListingStore {
+public:
+
+	// What to take out of the store
+	struct Filter {
+		Filter();
+		time_t since;		// found at or after this.  0 for no limit.
+		time_t until;		// found before this.  0 for no limit.
+		bool areaSet;		// only mappable listings inside 'area'
+		Bbox area;
+		string keyword;		// in the title or description, any case
+		int minPrice;		// only listings with an asking price in this range.
+		int maxPrice;		// 0 for no limit.
+	};
+
+	ListingStore();
+	~ListingStore();
+
+	// Add one block to the end of the store, creating it if it isn't
+	// there.  Safe to call from several processes at once.  Refuses to
+	// touch a file that isn't a store, or a store that is damaged.
+	static bool append(const string& storefile, const vector<const Listing*>& listings);
+
+	// Map a store for reading.  A block a crash left half written at the
+	// end is ignored.  A store that is damaged anywhere else isn't opened.
+	bool open(const string& storefile);
+	bool isOpen() { return data != NULL; }
+
+	// Listings in the store, counting every copy of each
+	size_t size() const { return rows; }
+
+	// The listings whose newest copy passes the filter.  Older copies of a
+	// listing are never returned.  The strings are only good while the
+	// store is open.
+	vector<Listing> select(const Filter& filter) const;
+
+protected:
+
+	// Each block is a header, then its columns in this order, each one
+	// padded to 8 bytes, then the strings the Spans point into.
+	struct BlockHeader {
+		char magic[8];
+		uint32_t count;
+		uint32_t stringBytes;
+	};
+	struct Span {
+		uint32_t offset;
+		uint32_t length;
+	};
+	struct Layout {
+		size_t found;		// int64_t
+		size_t lat;			// float
+		size_t lng;			// float
+		size_t price;		// int32_t
+		size_t status;		// uint8_t
+		size_t id;			// Span
+		size_t title;		// Span
+		size_t url;			// Span
+		size_t description;	// Span
+		size_t strings;
+		size_t size;
+	};
+	struct Block {
+		const char* base;
+		uint32_t count;
+		Layout layout;
+	};
+
+	static Layout layout(uint32_t count, uint32_t stringBytes);
+
+	// What the bytes at some point in a store are.  'bytes' holds the
+	// header there, or as much of it as the file has ('available').
+	enum BlockState { WHOLE, TORN, DAMAGED };
+	static BlockState blockState(const char* bytes, size_t available, size_t& blockSize);
+
+	// Where the last whole block in an open file ends.  False if the file
+	// isn't a store, or has something other than a torn block after it.
+	static bool validLength(int fd, off_t& valid);
+
+	Listing row(const Block& block, uint32_t i) const;
+
+	char* data;
+	size_t length;
+	vector<Block> blocks;
+	size_t rows;
+};
@@ -0,0 +1,222 @@
+/*
+ *  Metrics.cpp
+ *  craig2kml
+ *
+ */
+
+#include "Metrics.h"
+#include <fstream>
+#include <iomanip>
+#include <new>
+#include <cstdlib>
+#include <sys/time.h>
+
+// -------------------------------------------------------------
+bool Metrics::enabled = false;
+const double Metrics::bucketBounds[] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+const int Metrics::numBuckets = sizeof(Metrics::bucketBounds)/sizeof(double);
+map<const char*,unsigned long long,Metrics::NameLess> Metrics::counters;
+map<const char*,Metrics::Histogram,Metrics::NameLess> Metrics::histograms;
+pthread_mutex_t Metrics::mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile unsigned long Metrics::allocations = 0;
+volatile unsigned long Metrics::allocatedBytes = 0;
+
+
+// -------------------------------------------------------------
+// Every allocation in the program comes through here, so keep it cheap:
+// one flag check when metrics are off, two atomic adds when they are on.
+void* operator new(size_t n)
+{
+	if(Metrics::enabled)
+	{
+		__sync_fetch_and_add(&Metrics::allocations, 1);
+		__sync_fetch_and_add(&Metrics::allocatedBytes, n);
+	}
+	void* p = malloc(n ? n : 1);
+	if(p==NULL) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+
+// -------------------------------------------------------------
+Metrics::Histogram::Histogram()
+{
+	// one extra for +Inf
+	buckets.resize(Metrics::numBuckets+1, 0);
+	count = 0;
+	sum = 0;
+	min = 0;
+	max = 0;
+}
+
+
+// -------------------------------------------------------------
+double Metrics::now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+// -------------------------------------------------------------
+void Metrics::addCount(const char* name, unsigned long long n)
+{
+	pthread_mutex_lock(&mutex);
+	counters[name] += n;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+void Metrics::addSample(const char* stage, double seconds)
+{
+	int b=0;
+	while(b<numBuckets && seconds>bucketBounds[b]) b++;
+	
+	pthread_mutex_lock(&mutex);
+	Histogram& h = histograms[stage];
+	if(h.count==0 || seconds<h.min) h.min = seconds;
+	if(h.count==0 || seconds>h.max) h.max = seconds;
+	h.buckets[b]++;
+	h.count++;
+	h.sum += seconds;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+void Metrics::reset()
+{
+	pthread_mutex_lock(&mutex);
+	counters.clear();
+	histograms.clear();
+	allocations = 0;
+	allocatedBytes = 0;
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+bool Metrics::writeJSON(const string& path)
+{
+	ofstream out(path.c_str(), ios::out);
+	if(!out.is_open())
+	{
+		cerr << "ERROR: Couldn't write metrics to " << path << endl;
+		return false;
+	}
+	
+	pthread_mutex_lock(&mutex);
+	counters["heap_allocations"] = allocations;
+	counters["heap_allocated_bytes"] = allocatedBytes;
+	out << "{" << endl << "  \"counters\": {";
+	for(map<const char*,unsigned long long,NameLess>::iterator it=counters.begin(); it!=counters.end(); ++it)
+	{
+		out << (it==counters.begin() ? "" : ",") << endl;
+		out << "    \"" << it->first << "\": " << it->second;
+	}
+	out << endl << "  }," << endl << "  \"stages\": {";
+	for(map<const char*,Histogram,NameLess>::iterator it=histograms.begin(); it!=histograms.end(); ++it)
+	{
+		Histogram& h = it->second;
+		out << (it==histograms.begin() ? "" : ",") << endl;
+		out << "    \"" << it->first << "\": {"
+			<< "\"count\": " << h.count << ", "
+			<< setprecision(17)
+			<< "\"sum\": " << h.sum << ", "
+			<< "\"min\": " << h.min << ", "
+			<< "\"max\": " << h.max << ", "
+			<< setprecision(6)
+			<< "\"buckets\": [";
+		for(int b=0; b<=numBuckets; b++)
+		{
+			if(b>0) out << ", ";
+			if(b<numBuckets) out << "[" << bucketBounds[b] << ", " << h.buckets[b] << "]";
+			else out << "[\"+Inf\", " << h.buckets[b] << "]";
+		}
+		out << "]}";
+	}
+	out << endl << "  }" << endl << "}" << endl;
+	pthread_mutex_unlock(&mutex);
+	
+	out.close();
+	return true;
+}
+
+
+// -------------------------------------------------------------
+bool Metrics::writePrometheus(const string& path)
+{
+	ofstream out(path.c_str(), ios::out);
+	if(!out.is_open())
+	{
+		cerr << "ERROR: Couldn't write metrics to " << path << endl;
+		return false;
+	}
+	
+	pthread_mutex_lock(&mutex);
+	counters["heap_allocations"] = allocations;
+	counters["heap_allocated_bytes"] = allocatedBytes;
+	for(map<const char*,unsigned long long,NameLess>::iterator it=counters.begin(); it!=counters.end(); ++it)
+	{
+		out << "# TYPE craig2kml_" << it->first << "_total counter" << endl;
+		out << "craig2kml_" << it->first << "_total " << it->second << endl;
+	}
+	
+	if(!histograms.empty())
+		out << "# TYPE craig2kml_stage_seconds histogram" << endl;
+	for(map<const char*,Histogram,NameLess>::iterator it=histograms.begin(); it!=histograms.end(); ++it)
+	{
+		Histogram& h = it->second;
+		
+		// Prometheus buckets are cumulative
+		unsigned long cumulative = 0;
+		for(int b=0; b<=numBuckets; b++)
+		{
+			cumulative += h.buckets[b];
+			out << "craig2kml_stage_seconds_bucket{stage=\"" << it->first << "\",le=\"";
+			if(b<numBuckets) out << bucketBounds[b];
+			else out << "+Inf";
+			out << "\"} " << cumulative << endl;
+		}
+		out << "craig2kml_stage_seconds_sum{stage=\"" << it->first << "\"} " << setprecision(17) << h.sum << setprecision(6) << endl;
+		out << "craig2kml_stage_seconds_count{stage=\"" << it->first << "\"} " << h.count << endl;
+	}
+	pthread_mutex_unlock(&mutex);
+	
+	out.close();
+	return true;
+}
+
+
+// -------------------------------------------------------------
+Metrics::Timer::Timer(const char* _stage)
+{
+	stage = _stage;
+	start = Metrics::enabled ? Metrics::now() : 0;
+}
+
+
+// -------------------------------------------------------------
+Metrics::Timer::~Timer()
+{
+	stop();
+}
+
+
+// -------------------------------------------------------------
+void Metrics::Timer::stop()
+{
+	if(stage && Metrics::enabled)
+	{
+		Metrics::observe(stage, Metrics::now()-start);
+	}
+	stage = NULL;
+}
@@ -0,0 +1,84 @@
+/*
+ *  Metrics.h
+ *  craig2kml
+ *
+ *  Per-stage timers, counters and byte counts.  Everything is a no-op
+ *  unless Metrics::enabled is set (see the --metrics option).
+ *
+ */
+
+#pragma once
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <cstring>
+#include <pthread.h>
+
+using namespace std;
+class Metrics {
+public:
+	
+	// Nothing is recorded unless this is true.
+	static bool enabled;
+	
+	// Add n to a counter (cache_hits, bytes_downloaded, etc).  Inline, and
+	// the name isn't made into a string, so it costs one check when off.
+	// Names have to be string literals.
+	static void count(const char* name, unsigned long long n=1) { if(enabled) addCount(name, n); }
+	
+	// Record one sample (in seconds) in the latency histogram for a stage
+	static void observe(const char* stage, double seconds) { if(enabled) addSample(stage, seconds); }
+	
+	// Wall clock time in seconds
+	static double now();
+	
+	// Heap allocations made while enabled.  Counted by the global operator new in Metrics.cpp.
+	static volatile unsigned long allocations;
+	static volatile unsigned long allocatedBytes;
+	
+	// Forget everything recorded so far, such as in a process that was just forked
+	static void reset();
+	
+	// Dump everything that has been recorded
+	static bool writeJSON(const string& path);
+	static bool writePrometheus(const string& path);
+	
+	// Times the enclosing scope and records it under 'stage'
+	class Timer {
+	public:
+		Timer(const char* stage);
+		~Timer();
+		void stop();
+	protected:
+		const char* stage;
+		double start;
+	};
+	
+protected:
+	
+	static void addCount(const char* name, unsigned long long n);
+	static void addSample(const char* stage, double seconds);
+	
+	struct Histogram {
+		Histogram();
+		vector<unsigned long> buckets;
+		unsigned long count;
+		double sum;
+		double min;
+		double max;
+	};
+	
+	static const double bucketBounds[];
+	static const int numBuckets;
+	// Names are kept by pointer (they are all string literals), so that
+	// recording doesn't allocate once a name has been seen.
+	struct NameLess {
+		bool operator()(const char* a, const char* b) const { return strcmp(a, b) < 0; }
+	};
+	
+	// Whole numbers, so that big byte counts are written exactly
+	static map<const char*,unsigned long long,NameLess> counters;
+	static map<const char*,Histogram,NameLess> histograms;
+	static pthread_mutex_t mutex;
+};
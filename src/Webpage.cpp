@@ -8,11 +8,18 @@
  */
 
 #include "Webpage.h"
+#include "HostLatency.h"
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/stat.h>
 
 // -------------------------------------------------------------
 string Webpage::userAgent = "Mozilla/5.0";
 string Webpage::cacheDirectory = "";
-bool Webpage::libxmlInited = false;
+long Webpage::timeoutMs = 2000;
+double Webpage::deadline = 0;
+pthread_once_t Webpage::initOnce = PTHREAD_ONCE_INIT;
 
 
 
@@ -20,22 +27,35 @@ bool Webpage::libxmlInited = false;
 Webpage::Webpage()
 {
 	verbose = false;
-	if(!Webpage::libxmlInited)
-	{
-		if(verbose)
-			cerr << "Initializing libxml." << endl;
-		xmlInitParser();
-		Webpage::libxmlInited = true;
-	}
+	cached = false;
+	doc = NULL;
+	xpathCtx = NULL;
+	init();
+}
+
+
+// -------------------------------------------------------------
+void Webpage::init()
+{
+	pthread_once(&initOnce, initLibraries);
+}
+
+
+// -------------------------------------------------------------
+// Neither library's global setup is thread safe, and both would
+// otherwise do it lazily the first time a page is used.
+void Webpage::initLibraries()
+{
+	xmlInitParser();
+	curl_global_init(CURL_GLOBAL_ALL);
 }
 
 
 // -------------------------------------------------------------
 Webpage::~Webpage()
 {
-	// TO DO:  FIX THIS STUPID!
-	//xmlFreeDoc(doc);
-	//xmlXPathFreeContext(xpathCtx); 
+	if(xpathCtx) xmlXPathFreeContext(xpathCtx);
+	if(doc) xmlFreeDoc(doc);
 }
 
 
@@ -47,38 +67,83 @@ void Webpage::setVerbose(bool _verbose)
 
 
 // -------------------------------------------------------------
-bool Webpage::open(string url, bool wellFormed, bool useCache)
+bool Webpage::open(const string& url, bool wellFormed, bool useCache)
 {	
+	return fetch(url, useCache) && prepare(wellFormed);
+}
+
+
+// -------------------------------------------------------------
+bool Webpage::fetch(const string& url, bool useCache)
+{
 	if(Webpage::cacheDirectory.empty())
 	{
 		useCache=false;
 	}
 	
-	bool loaded=false;
+	cached=false;
+	cachefile.clear();
 	if(useCache)
 	{
-		locale loc;
-		const collate<char>& coll = use_facet<collate<char> >(loc);
-		long myhash = coll.hash(url.data(),url.data()+url.length());
-		sprintf(cachefile, "%s/%ld.cache", Webpage::cacheDirectory.c_str(), myhash);
-		
-		loaded = loadFromCache();
+		cachefile = cachePath(url);
+		cached = loadFromCache();
+		Metrics::count(cached ? "cache_hits" : "cache_misses");
 	}
 	
-	if(!loaded)
+	if(!cached)
 	{
-		contents = download(url, verbose);
+		string downloaded = download(url, verbose);
+		contents.swap(downloaded);
 		if(contents.empty())
 		{
 			if(verbose) cerr << "No contents downloaded." << endl;
 			return false;
 		}
-		if(!wellFormed)
-		{
-			tidy_me();
-		}
+	}
+	return true;
+}
+
+
+// -------------------------------------------------------------
+bool Webpage::prepare(bool wellFormed)
+{
+	// The cache holds documents that have already been tidied.
+	if(!cached && !wellFormed)
+	{
+		Metrics::Timer timer("tidy");
+		tidy_me();
 	}
 	
+	if(!parse())
+	{
+		return false;
+	}
+
+	// A document that came from the cache is already there
+	if(!cached && !cachefile.empty())
+	{
+		saveToCache();
+	}
+	return true;
+}
+
+
+// -------------------------------------------------------------
+bool Webpage::load(const string& html, bool wellFormed)
+{
+	contents = html;
+	if(!wellFormed)
+	{
+		Metrics::Timer timer("tidy");
+		tidy_me();
+	}
+	return parse();
+}
+
+
+// -------------------------------------------------------------
+bool Webpage::parse()
+{
 	// get rid of doctype line.  It messes up the parser
 	string prefix = "<!DOCTYPE";
 	if(contents.compare(0, prefix.size(), prefix)==0)
@@ -94,17 +159,18 @@ bool Webpage::open(string url, bool wellFormed, bool useCache)
 	{
 		contents.erase(end+7);
 	}
-
-	if(useCache)
-	{
-		saveToCache();
-	}
 	
 	if(verbose)
 		cerr << "Parsing document. Length: " << contents.length() << endl;
 	
+	// Webpages can be reused
+	if(xpathCtx) xmlXPathFreeContext(xpathCtx);
+	if(doc) xmlFreeDoc(doc);
+	xpathCtx = NULL;
 	
+	Metrics::Timer parseTimer("parse");
 	doc = xmlParseMemory(contents.c_str(), contents.length());
+	parseTimer.stop();
 	if (doc == NULL) {
 		if(verbose)
 			cerr << "ERROR: Unable to parse HTML" << endl;
@@ -114,6 +180,7 @@ bool Webpage::open(string url, bool wellFormed, bool useCache)
 	xpathCtx = xmlXPathNewContext(doc);
 	if(xpathCtx == NULL) {
 		xmlFreeDoc(doc);
+		doc = NULL;
 		if(verbose)
 			cerr << "ERROR: Unable to create new XPath context" << endl;
 		return false;
@@ -124,20 +191,48 @@ bool Webpage::open(string url, bool wellFormed, bool useCache)
 
 
 // -------------------------------------------------------------
+string Webpage::cachePath(const string& url)
+{
+	locale loc;
+	const collate<char>& coll = use_facet<collate<char> >(loc);
+	long myhash = coll.hash(url.data(),url.data()+url.length());
+	char path[255];
+	snprintf(path, sizeof(path), "%s/%ld.cache", Webpage::cacheDirectory.c_str(), myhash);
+	return path;
+}
+
+
+// -------------------------------------------------------------
+// Written to a temporary file and renamed into place, so that another
+// thread or process reading the same cache file never sees half of it.
 bool Webpage::saveToCache()
 {
-	ofstream myfile;
-	myfile.open(cachefile, ios::out);
-	if(myfile.is_open())
+	string temp = cachefile + ".XXXXXX";
+	int fd = mkstemp(&temp[0]);
+	bool ok = (fd >= 0 && fchmod(fd, 0644) == 0);
+	size_t written = 0;
+	while(ok && written < contents.length())
+	{
+		ssize_t n = ::write(fd, contents.data()+written, contents.length()-written);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) ok = false;
+		else written += n;
+	}
+	if(fd >= 0 && ::close(fd) != 0)
+		ok = false;
+	if(ok && rename(temp.c_str(), cachefile.c_str()) != 0)
+		ok = false;
+
+	if(ok)
 	{
 		if(verbose) 
 			cerr << "Writing cachefile: " << cachefile << endl;
-		myfile << contents;
-		myfile.close();
 		return true;
 	}
 	else
 	{
+		if(fd >= 0)
+			unlink(temp.c_str());
 		if(verbose) 
 			cerr << "ERROR:  Couldn't write to " << cachefile << endl;
 		return false;
@@ -147,19 +242,25 @@ bool Webpage::saveToCache()
 // -------------------------------------------------------------
 bool Webpage::loadFromCache()
 {
-	string line;
-	ifstream myfile(cachefile);
+	ifstream myfile(cachefile.c_str(), ios::in | ios::binary);
 	if(myfile.is_open())
 	{
 		if(verbose) 
 			cerr << "loading from cache: " << cachefile << endl;
 		
-		while ( myfile.good() )
-		{
-			getline(myfile,line);
-			contents += line+"\n";
-		}
+		// Read it in one go, rather than a line (and an allocation) at a time
+		myfile.seekg(0, ios::end);
+		contents.resize((size_t)myfile.tellg());
+		myfile.seekg(0, ios::beg);
+		if(!contents.empty())
+			myfile.read(&contents[0], contents.length());
 		myfile.close();
+
+		// Only an interrupted write leaves an empty file.  Nothing is ever
+		// cached empty, so it is a miss.
+		if(contents.empty())
+			return false;
+		Metrics::count("bytes_cache_read", contents.length());
 		return true;
 	} else {
 		return false;
@@ -168,39 +269,164 @@ bool Webpage::loadFromCache()
 
 
 // -------------------------------------------------------------
-string Webpage::download(string url, bool verbose)
+// One transfer of a download.  There are two when the first is hedged.
+struct Transfer {
+	CURL* curl;
+	string body;
+	char errorBuffer[CURL_ERROR_SIZE];
+	CURLcode result;
+	long httpCode;
+	bool finished;
+};
+
+static bool start_transfer(CURLM* multi, Transfer& t, const string& url, struct curl_slist* headers, long timeout,
+	int (*writeData)(char*, size_t, size_t, std::string*))
 {
-	string str;
-	
-	if(verbose) 
-		cerr << "downloading..." << endl;
+	t.curl = curl_easy_init();
+	t.result = CURLE_OK;
+	t.httpCode = 0;
+	t.finished = false;
+	if(!t.curl)
+		return false;
 	
-	static char errorBuffer[CURL_ERROR_SIZE];
-	CURL *curl = curl_easy_init();
-	CURLcode result;
-	if (!curl) {
-		throw "Couldn't create CURL object.";
+	curl_easy_setopt(t.curl, CURLOPT_ERRORBUFFER, t.errorBuffer);
+	curl_easy_setopt(t.curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(t.curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(t.curl, CURLOPT_TIMEOUT_MS, timeout);
+	curl_easy_setopt(t.curl, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(t.curl, CURLOPT_FOLLOWLOCATION, 1);
+	curl_easy_setopt(t.curl, CURLOPT_WRITEFUNCTION, writeData);
+	curl_easy_setopt(t.curl, CURLOPT_WRITEDATA, &t.body);
+	curl_multi_add_handle(multi, t.curl);
+	HostLatency::started();
+	return true;
+}
+
+// -------------------------------------------------------------
+string Webpage::download(const string& url, bool verbose)
+{
+	string host = HostLatency::hostOf(url);
+	long timeout = HostLatency::timeoutMs(host, Webpage::timeoutMs);
+	bool cutShort = false;
+	if(Webpage::deadline > 0)
+	{
+		long remaining = (long)((Webpage::deadline - Metrics::now()) * 1000);
+		if(remaining <= 0)
+		{
+			if(verbose) cerr << "Out of time. Not downloading." << endl;
+			Metrics::count("deadline_expired");
+			return "";
+		}
+		cutShort = remaining < timeout;
+		timeout = min(timeout, remaining);
 	}
 	
+	// A request that runs past the host's p95 is sent again, if the hedging budget allows.
+	double hedgeAfter = HostLatency::hedgeFraction > 0 ? HostLatency::percentile(host, 0.95) : 0;
+	
+	if(verbose) 
+		cerr << "downloading (timeout " << timeout << "ms)..." << endl;
+	
 	// Set the headers
 	struct curl_slist *headers=NULL;
 	char user_agent_header[255];
 	sprintf(user_agent_header, "User-Agent: %s", Webpage::userAgent.c_str());
 	headers = curl_slist_append(headers, user_agent_header);
 	
+	CURLM* multi = curl_multi_init();
+	Transfer transfers[2];
+	int started = 0;
+	if (!multi || !start_transfer(multi, transfers[0], url, headers, timeout, writeData)) {
+		if(multi) curl_multi_cleanup(multi);
+		curl_slist_free_all(headers);
+		throw "Couldn't create CURL object.";
+	}
+	started = 1;
+	
+	// Run the transfers until one of them gets a good response, or all of them have failed.
+	Metrics::Timer timer("download");
+	double startTime = Metrics::now();
+	Transfer* winner = NULL;
+	int finished = 0;
+	while(winner == NULL && finished < started)
+	{
+		int running;
+		curl_multi_perform(multi, &running);
+		
+		CURLMsg* msg;
+		int left;
+		while((msg = curl_multi_info_read(multi, &left)) != NULL)
+		{
+			if(msg->msg != CURLMSG_DONE) continue;
+			for(int i=0; i<started; i++)
+			{
+				Transfer& t = transfers[i];
+				if(t.curl != msg->easy_handle || t.finished) continue;
+				t.finished = true;
+				t.result = msg->data.result;
+				curl_easy_getinfo(t.curl, CURLINFO_RESPONSE_CODE, &t.httpCode);
+				finished++;
+				if(t.result == CURLE_OK && t.httpCode == 200 && winner == NULL)
+				{
+					winner = &t;
+					if(i > 0) Metrics::count("hedge_wins");
+				}
+			}
+		}
+		if(winner != NULL || finished == started)
+			break;
+		
+		double elapsed = Metrics::now() - startTime;
+		if(started == 1 && hedgeAfter > 0 && elapsed > hedgeAfter && elapsed*1000 < timeout && HostLatency::mayHedge())
+		{
+			if(verbose) 
+				cerr << "No answer after " << (int)(elapsed*1000) << "ms.  Hedging." << endl;
+			if(start_transfer(multi, transfers[1], url, headers, timeout - (long)(elapsed*1000), writeData))
+			{
+				started = 2;
+				Metrics::count("hedges");
+			}
+		}
+		
+		curl_multi_wait(multi, NULL, 0, 10, NULL);
+	}
+	timer.stop();
+	
+	// Report on the transfer that counted: the winner, or else the first.
+	Transfer& t = winner ? *winner : transfers[0];
 	
-	// TO DO:
-	// Set timeout limit
-	// put the whoel thing in a try block
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
-	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 2000);
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeData);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &str);
-	result = curl_easy_perform(curl);
-	curl_easy_cleanup(curl);
+	// Only answers are samples.  A request that ran out the host's own
+	// timeout says it is slower than that, but not by how much.  Other
+	// failures, and the deadline cutting a request off, say nothing.
+	if(winner)
+		HostLatency::record(host, Metrics::now() - startTime);
+	else if(t.result == CURLE_OPERATION_TIMEDOUT && !cutShort)
+		HostLatency::timedOut(host);
+	if(Metrics::enabled)
+	{
+		double v;
+		curl_easy_getinfo(t.curl, CURLINFO_NAMELOOKUP_TIME, &v);		Metrics::observe("curl_namelookup", v);
+		curl_easy_getinfo(t.curl, CURLINFO_CONNECT_TIME, &v);			Metrics::observe("curl_connect", v);
+		curl_easy_getinfo(t.curl, CURLINFO_APPCONNECT_TIME, &v);		Metrics::observe("curl_appconnect", v);
+		curl_easy_getinfo(t.curl, CURLINFO_PRETRANSFER_TIME, &v);		Metrics::observe("curl_pretransfer", v);
+		curl_easy_getinfo(t.curl, CURLINFO_STARTTRANSFER_TIME, &v);	Metrics::observe("curl_starttransfer", v);
+		curl_easy_getinfo(t.curl, CURLINFO_TOTAL_TIME, &v);			Metrics::observe("curl_total", v);
+		Metrics::count("requests", started);
+		for(int i=0; i<started; i++)
+			Metrics::count("bytes_downloaded", transfers[i].body.length());
+	}
+	
+	string str;
+	CURLcode result = t.result;
+	long http_code = t.httpCode;
+	str.swap(t.body);
+	
+	for(int i=0; i<started; i++)
+	{
+		curl_multi_remove_handle(multi, transfers[i].curl);
+		curl_easy_cleanup(transfers[i].curl);
+	}
+	curl_multi_cleanup(multi);
 	curl_slist_free_all(headers);
 	
 	
@@ -208,17 +434,17 @@ string Webpage::download(string url, bool verbose)
 	if (result != CURLE_OK)
 	{
 		if(verbose) cerr << "Bad result from CURL" << endl;
+		Metrics::count("curl_errors");
 		return "";						
 	}
 	
-	long http_code = 0;
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 	char status_msg[255];
 	sprintf(status_msg, "HTTP status code: %ld", http_code);
 	if(verbose) cerr << status_msg << endl;
 	if (http_code != 200 || result == CURLE_ABORTED_BY_CALLBACK)
 	{
 		if(verbose) cerr << "HTTP error" << endl;
+		Metrics::count("http_errors");
 		return "";
 	}
 	
@@ -263,7 +489,13 @@ void Webpage::tidy_me()
 				buffer = (tmbstr)malloc(buflen + 1);
 			}
 		} while (status == -ENOMEM);
-		contents = (char*)buffer;
+		// The output is not NUL terminated, so use the length.
+		if(buffer)
+			contents.assign((char*)buffer, buflen);
+		else
+			contents.clear();
+		free(buffer);
+		tidyRelease(_tdoc);
 
 	} catch (exception& e) {
 		throw e.what();
@@ -271,13 +503,15 @@ void Webpage::tidy_me()
 }
 
 // -------------------------------------------------------------
-xmlXPathObjectPtr Webpage::xpath(string exp)
+xmlXPathObjectPtr Webpage::xpath(const string& exp)
 {		
+	Metrics::Timer timer("xpath");
 	const xmlChar* xpathExpr = BAD_CAST exp.c_str();
 	xmlXPathObjectPtr xpathObj = xmlXPathEvalExpression(xpathExpr, xpathCtx);
 	if(xpathObj == NULL)
 	{
 		xmlXPathFreeContext(xpathCtx);
+		xpathCtx = NULL;
 		throw std::runtime_error("Error: unable to evaluate xpath expression");
 	}
 	//std::cout << "results: " << xpathObj->nodesetval->nodeNr << endl;
@@ -285,31 +519,54 @@ xmlXPathObjectPtr Webpage::xpath(string exp)
 }
 
 // -------------------------------------------------------------
-map<string,string> Webpage::getLinks(string exp)
+// Orders links by title, and keeps the last of any with the same title.
+static bool compareLinks(const Link& a, const Link& b)
 {
-	map<string,string> links;
+	return a.title < b.title;
+}
+
+vector<Link> Webpage::getLinks(const string& exp, Arena* arena)
+{
+	if(!arena) arena = &strings;
+	
+	vector<Link> links;
 	xmlXPathObjectPtr obj = xpath(exp);
 	xmlNodeSetPtr nodeset = obj->nodesetval;
 	
-	for (int i=0; i<nodeset->nodeNr; i++)
+	for (int i=0; nodeset && i<nodeset->nodeNr; i++)
 	{
 		xmlChar *href, *title;
 		href = xmlGetProp(nodeset->nodeTab[i], (const xmlChar *)"href");
 		title = xmlNodeListGetString(doc, nodeset->nodeTab[i]->xmlChildrenNode, 1);
 		if(href && title)
 		{
-			links[(const char*)title] = (const char*)href;
+			Link link;
+			link.title = arena->copy((const char*)title);
+			link.href = arena->copy((const char*)href);
+			links.push_back(link);
 		}
+		if(href) xmlFree(href);
+		if(title) xmlFree(title);
 	}
-
 	xmlXPathFreeObject(obj);
-	return links;
+	
+	stable_sort(links.begin(), links.end(), compareLinks);
+	vector<Link> unique;
+	for(size_t i=0; i<links.size(); i++)
+	{
+		if(i+1 < links.size() && links[i].title == links[i+1].title) continue;
+		unique.push_back(links[i]);
+	}
+	return unique;
 }
 
 
 // -------------------------------------------------------------
-const char* Webpage::getNodeAsString(string exp)
+StringRef Webpage::getNodeAsString(const string& exp, Arena* arena)
 {
+	if(!arena) arena = &strings;
+	
+	StringRef str;
 	xmlXPathObjectPtr obj = xpath(exp);
 	xmlNodeSetPtr nodeset = obj->nodesetval;
 	if(nodeset && nodeset->nodeNr>0)
@@ -322,45 +579,85 @@ const char* Webpage::getNodeAsString(string exp)
 			xmlSaveTree(savectx, node);
 			xmlSaveClose(savectx);
 		}
-		return (const char*)xmlBufferContent(buf);
+		str = arena->copy((const char*)xmlBufferContent(buf), xmlBufferLength(buf));
+		xmlBufferFree(buf);
 	}
-	else
+	else if(verbose)
 	{	
-		cout << "no node found" << endl;
-		return "";
+		cerr << "no node found" << endl;
+	}
+	xmlXPathFreeObject(obj);
+	return str;
+}
+
+// -------------------------------------------------------------
+StringRef Webpage::getNodeDescription(const string& exp, const Description& format, const string& url, Arena* arena)
+{
+	if(format.mode == Description::FULL)
+		return getNodeAsString(exp, arena);
+	
+	if(!arena) arena = &strings;
+	
+	xmlXPathObjectPtr obj = xpath(exp);
+	xmlNodeSetPtr nodeset = obj->nodesetval;
+	xmlNodePtr node = (nodeset && nodeset->nodeNr > 0) ? nodeset->nodeTab[0] : NULL;
+	if(node==NULL && verbose)
+	{
+		cerr << "no node found" << endl;
 	}
+	
+	Metrics::Timer timer("describe");
+	StringRef str = arena->copy(format.render(node, url));
+	timer.stop();
+	xmlXPathFreeObject(obj);
+	
+	return str;
 }
 
 // -------------------------------------------------------------
-const char* Webpage::getNodeAttribute(string exp, string attrib)
+StringRef Webpage::getNodeAttribute(const string& exp, const string& attrib, Arena* arena)
 {
-	const xmlChar* contents=(const xmlChar*)"";
+	if(!arena) arena = &strings;
+	
+	StringRef str;
 	xmlXPathObjectPtr obj = xpath(exp);
 	xmlNodeSetPtr nodeset = obj->nodesetval;
 	
 	if(nodeset && nodeset->nodeNr > 0)
 	{
-		contents = xmlGetProp(nodeset->nodeTab[0], (const xmlChar *)attrib.c_str());
+		xmlChar* contents = xmlGetProp(nodeset->nodeTab[0], (const xmlChar *)attrib.c_str());
+		if(contents)
+		{
+			str = arena->copy((const char*)contents);
+			xmlFree(contents);
+		}
 	}
 	xmlXPathFreeObject(obj);
 
-	return (const char*)contents;
+	return str;
 }
 
 // -------------------------------------------------------------
-const char* Webpage::getNodeContents(string exp)
+StringRef Webpage::getNodeContents(const string& exp, Arena* arena)
 {
-	const xmlChar* contents;
+	if(!arena) arena = &strings;
+	
+	StringRef str;
 	xmlXPathObjectPtr obj = xpath(exp);
 	xmlNodeSetPtr nodeset = obj->nodesetval;
 	
 	if(nodeset && nodeset->nodeNr > 0)
 	{
-		contents =  xmlNodeListGetString(doc, nodeset->nodeTab[0]->children, 1);
+		xmlChar* contents = xmlNodeListGetString(doc, nodeset->nodeTab[0]->children, 1);
+		if(contents)
+		{
+			str = arena->copy((const char*)contents);
+			xmlFree(contents);
+		}
 	}
 	xmlXPathFreeObject(obj);
 	
-	return (const char*)contents;
+	return str;
 }
 
 // -------------------------------------------------------------
@@ -28,50 +28,96 @@
 #include <iostream>
 #include <fstream>
 #include <sys/errno.h>
+#include <pthread.h>
+#include "Metrics.h"
+#include "Arena.h"
+#include "Description.h"
 //#include <pcrecpp.h>
 
 using namespace std;
+
+// One link found by Webpage::getLinks
+struct Link {
+	StringRef title;
+	StringRef href;
+};
+
 class Webpage {
 public:
 	
 	Webpage();
 	~Webpage();
 
-	// Load in a URL
-	bool open(string url, bool wellFormed=false, bool useCache=true);
+	// Load in a URL.  Same as fetch followed by prepare.
+	bool open(const string& url, bool wellFormed=false, bool useCache=true);
+	
+	// Get the document from the cache or the network, without parsing it.
+	// This is the only part of open that waits on I/O.
+	bool fetch(const string& url, bool useCache=true);
+	
+	// Tidy and parse whatever fetch got, and save it to the cache.
+	bool prepare(bool wellFormed=false);
+	
+	// Parse a document that is already in memory
+	bool load(const string& html, bool wellFormed=false);
 	
 	// Run TidyLib on 'contents'
 	void tidy_me();
 	
-	// Gets a map of the content and href od all links within a given xpath expression
-	map<string,string> getLinks(string exp);
+	// Gets the content and href of all links within a given xpath expression, sorted by content
+	vector<Link> getLinks(const string& exp, Arena* arena=NULL);
 	
-	// Node stuff
-	const char* getNodeAsString(string exp);
-	const char* getNodeContents(string exp);
-	const char* getNodeAttribute(string exp, string atrrib);
+	// Node stuff.  The strings are copied into 'arena', or into the page's
+	// own arena (and live as long as the page) if none is given.
+	StringRef getNodeAsString(const string& exp, Arena* arena=NULL);
+	StringRef getNodeContents(const string& exp, Arena* arena=NULL);
+	StringRef getNodeAttribute(const string& exp, const string& attrib, Arena* arena=NULL);
+	
+	// The node cut down to what 'format' asks for.  'url' is the page's own, for summaries.
+	StringRef getNodeDescription(const string& exp, const Description& format, const string& url, Arena* arena=NULL);
 
 	// Cache stuff
 	bool loadFromCache();
 	bool saveToCache();
+	static string cachePath(const string& url);
 	
 	//int contentLength() {	return contents.length();	}
 	
 	void setVerbose(bool _verbose);
 	
-	static string download(string url, bool verbose=false);
+	static string download(const string& url, bool verbose=false);
 	static string userAgent;
 	static string cacheDirectory;
 	
+	// Longest a download may take from a host we know nothing about yet.  After
+	// a few requests, each host gets a timeout from its own response times (see HostLatency).
+	static long timeoutMs;
+	
+	// No download may run past this time (as returned by Metrics::now).  0 means no deadline.
+	static double deadline;
+	
+	// Set up libxml and libcurl.  Safe to call from any thread, any number
+	// of times; it has to have happened before pages are used on several threads.
+	static void init();
+	
 protected:
 	
-	static bool libxmlInited;
+	static pthread_once_t initOnce;
+	static void initLibraries();
 	bool verbose;
-	xmlXPathObjectPtr xpath(string exp);
+	bool cached;
+	bool parse();
+	xmlXPathObjectPtr xpath(const string& exp);
 	static int writeData(char *data, size_t size, size_t nmemb, std::string *buffer);
-	char cachefile[255];
+	string cachefile;
 	xmlDocPtr doc;
 	xmlXPathContextPtr xpathCtx;
 	string contents;
+	Arena strings;
+	
+private:
+	// Webpages own their libxml document, so they can't be copied.
+	Webpage(const Webpage&);
+	Webpage& operator=(const Webpage&);
 };
 
@@ -0,0 +1,197 @@
+/*
+ *  WorkerPool.cpp
+ *  craig2kml
+ *
+ */
+
+#include "WorkerPool.h"
+#include <unistd.h>
+
+// Lets a thread find out which worker it is.  Holds its Thread, or NULL if it isn't one.
+static pthread_key_t workerKey;
+static pthread_once_t workerKeyOnce = PTHREAD_ONCE_INIT;
+static void create_worker_key() { pthread_key_create(&workerKey, NULL); }
+
+
+// -------------------------------------------------------------
+WorkerPool::WorkerPool(int n)
+{
+	pthread_once(&workerKeyOnce, create_worker_key);
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&workAvailable, NULL);
+	pthread_cond_init(&allDone, NULL);
+	queued = 0;
+	pending = 0;
+	nextQueue = 0;
+	stopping = false;
+
+	if(n <= 0) n = cores();
+	for(int i=0; i<n; i++)
+	{
+		Queue* queue = new Queue;
+		pthread_mutex_init(&queue->mutex, NULL);
+		queues.push_back(queue);
+	}
+
+	// Only start the threads once every queue exists, since they steal from each other.
+	for(int i=0; i<n; i++)
+	{
+		Thread* thread = new Thread;
+		thread->pool = this;
+		thread->index = i;
+		if(pthread_create(&thread->thread, NULL, threadMain, thread) != 0)
+		{
+			delete thread;
+			break;
+		}
+		threads.push_back(thread);
+	}
+}
+
+
+// -------------------------------------------------------------
+WorkerPool::~WorkerPool()
+{
+	wait();
+
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&workAvailable);
+	pthread_mutex_unlock(&mutex);
+
+	for(size_t i=0; i<threads.size(); i++)
+	{
+		pthread_join(threads[i]->thread, NULL);
+		delete threads[i];
+	}
+	for(size_t i=0; i<queues.size(); i++)
+	{
+		pthread_mutex_destroy(&queues[i]->mutex);
+		delete queues[i];
+	}
+	pthread_cond_destroy(&allDone);
+	pthread_cond_destroy(&workAvailable);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+// -------------------------------------------------------------
+int WorkerPool::cores()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+
+// -------------------------------------------------------------
+int WorkerPool::currentWorker() const
+{
+	Thread* thread = (Thread*)pthread_getspecific(workerKey);
+	return (thread && thread->pool == this) ? thread->index : -1;
+}
+
+
+// -------------------------------------------------------------
+void WorkerPool::submit(Function fn, void* arg)
+{
+	Task task;
+	task.fn = fn;
+	task.arg = arg;
+
+	// If every thread failed to start, do the work right here.
+	if(threads.empty())
+	{
+		fn(arg);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	int self = currentWorker();
+	Queue* queue = (self >= 0) ? queues[self] : queues[nextQueue++ % threads.size()];
+	pthread_mutex_lock(&queue->mutex);
+	queue->tasks.push_back(task);
+	pthread_mutex_unlock(&queue->mutex);
+	queued++;
+	pending++;
+	pthread_cond_signal(&workAvailable);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+void WorkerPool::wait()
+{
+	pthread_mutex_lock(&mutex);
+	while(pending > 0)
+		pthread_cond_wait(&allDone, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+// -------------------------------------------------------------
+// The newest task from our own queue, or else the oldest from someone else's.
+bool WorkerPool::take(int self, Task& task)
+{
+	bool found = false;
+	for(size_t i=0; i<queues.size() && !found; i++)
+	{
+		Queue* queue = queues[(self+i) % queues.size()];
+		pthread_mutex_lock(&queue->mutex);
+		if(!queue->tasks.empty())
+		{
+			if(i == 0)
+			{
+				task = queue->tasks.back();
+				queue->tasks.pop_back();
+			}
+			else
+			{
+				task = queue->tasks.front();
+				queue->tasks.pop_front();
+			}
+			found = true;
+		}
+		pthread_mutex_unlock(&queue->mutex);
+	}
+
+	if(found)
+	{
+		pthread_mutex_lock(&mutex);
+		queued--;
+		pthread_mutex_unlock(&mutex);
+	}
+	return found;
+}
+
+
+// -------------------------------------------------------------
+void* WorkerPool::threadMain(void* arg)
+{
+	Thread* thread = (Thread*)arg;
+	WorkerPool* pool = thread->pool;
+	pthread_setspecific(workerKey, thread);
+
+	while(true)
+	{
+		Task task;
+		if(pool->take(thread->index, task))
+		{
+			task.fn(task.arg);
+
+			pthread_mutex_lock(&pool->mutex);
+			if(--pool->pending == 0)
+				pthread_cond_broadcast(&pool->allDone);
+			pthread_mutex_unlock(&pool->mutex);
+			continue;
+		}
+
+		// Nothing anywhere.  Sleep until something is submitted.
+		pthread_mutex_lock(&pool->mutex);
+		while(pool->queued <= 0 && !pool->stopping)
+			pthread_cond_wait(&pool->workAvailable, &pool->mutex);
+		bool done = pool->stopping && pool->queued <= 0;
+		pthread_mutex_unlock(&pool->mutex);
+		if(done) break;
+	}
+	return NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ *  WorkerPool.h
+ *  craig2kml
+ *
+ *  A fixed set of threads that run queued tasks.  Every thread has its own
+ *  queue: it takes its newest task first and, when it runs dry, steals the
+ *  oldest task from one of the others.  Tasks submitted from inside a task
+ *  go on the submitting thread's queue, so related work stays together.
+ *
+ */
+
+#pragma once
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+using namespace std;
+
+class WorkerPool {
+public:
+
+	typedef void (*Function)(void* arg);
+
+	// 0 threads means one per core
+	WorkerPool(int threads=0);
+
+	// Finishes everything that was submitted, then stops the threads
+	~WorkerPool();
+
+	// Queue fn(arg) to run on one of the threads
+	void submit(Function fn, void* arg);
+
+	// Block until every submitted task has finished.  Not for use inside a task.
+	void wait();
+
+	int size() const { return (int)threads.size(); }
+
+	// Which of this pool's threads the caller is (0 to size()-1), or -1 if it isn't one of them
+	int currentWorker() const;
+
+	static int cores();
+
+protected:
+
+	struct Task {
+		Function fn;
+		void* arg;
+	};
+
+	struct Queue {
+		pthread_mutex_t mutex;
+		deque<Task> tasks;
+	};
+
+	struct Thread {
+		WorkerPool* pool;
+		int index;
+		pthread_t thread;
+	};
+
+	static void* threadMain(void* arg);
+	bool take(int self, Task& task);
+
+	vector<Queue*> queues;
+	vector<Thread*> threads;
+
+	// Guards everything below
+	pthread_mutex_t mutex;
+	pthread_cond_t workAvailable;
+	pthread_cond_t allDone;
+	int queued;		// waiting in a queue
+	int pending;	// submitted and not yet finished
+	unsigned int nextQueue;
+	bool stopping;
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+};
@@ -11,8 +11,20 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <deque>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <cerrno>
 #include "Webpage.h"
 #include "Craig2KML.h"
+#include "Listing.h"
+#include "Gazetteer.h"
+#include "WorkerPool.h"
+#include "HostLatency.h"
+#include "ListingStore.h"
 #include <pcrecpp.h>
 
 // All of these vars are set with command line options
@@ -20,9 +32,74 @@ const char* outfilepath=NULL;
 const char* url=NULL;
 const char* configfilename=NULL;
 const char* cachedir=NULL;
+const char* metricsbase=NULL;
 bool verbose=false;
 int maxListings=999;
+double deadlineSeconds=0;
+const char* statefilepath=NULL;
+double watchInterval=0;
+const char* gazetteerpath=NULL;
+int cpuThreads=0;
+int connections=4;
+int shardIndex=-1;
+int shardCount=0;
+int localShards=0;
+vector<const char*> mergeFiles;
+bool viewportSet=false;
+Bbox viewport;
+int topListings=0;
+const char* storepath=NULL;
+const char* fromstorepath=NULL;
+ListingStore::Filter storeFilter;
 
+// Local shard workers all start from the coordinator's copy of the search
+// page, so they agree on which listings there are and in what order.
+string searchPage;
+time_t searchPageTime=0;
+
+// When we have to stop starting new work.  0 means never.
+double deadline=0;
+volatile sig_atomic_t stopRequested=0;
+
+// Every listing we have already processed, by posting ID.  Their strings
+// live in 'arena' for as long as the program runs.
+Arena arena;
+map<StringRef,Listing> seen;
+
+// Tried before the geocoding service, if there is one.
+Gazetteer gazetteer;
+
+// How listing descriptions are cut down.  Set from the config.
+Description descriptionFormat;
+
+// Downloads happen on 'network', everything that only needs the CPU
+// (tidy, parsing, xpath, gazetteer lookups) on 'cpu'.  Each CPU worker
+// copies what it extracts into its own arena.  What a crawl keeps is
+// copied into 'arena', and the worker arenas are emptied after it.
+WorkerPool* network=NULL;
+WorkerPool* cpu=NULL;
+vector<Arena*> workerArenas;
+
+// One listing on its way through the stages.
+struct ListingJob {
+	Listing* listing;
+	map<string,string>* config;
+	Webpage* page;
+	string addr;
+	size_t index;
+	size_t total;
+	double start;
+};
+
+// Shared by the stages of one crawl.  Guarded by jobsMutex.
+pthread_mutex_t jobsMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jobsDone = PTHREAD_COND_INITIALIZER;
+vector<ListingJob*> fetchQueue;
+size_t nextFetch=0;
+deque<ListingJob*> geocodeQueue;
+int jobsRemaining=0;
+int jobsFinished=0;
+double averageListing=0;
 
 
 // Some helper functions.
@@ -31,6 +108,34 @@ void parse_args(int argc, char* argv[]);
 void help();
 map<string,string> default_config();
 string truncate(string str, int n=60);
+void write_metrics();
+int crawl(map<string,string>& config);
+void fetch_listings(void* arg);
+void fetch_listing(ListingJob* job);
+void extract_listing(void* arg);
+void geocode_next(void* arg);
+void geocode_listing(ListingJob* job);
+void failed_listing(ListingJob* job);
+void finish_listing(ListingJob* job);
+bool write_output(Craig2KML& c2k);
+bool can_replace(const char* path);
+int run_shards(map<string,string>& config);
+unsigned int fnv1a(const char* data, size_t length, unsigned int hash=2166136261U);
+bool in_shard(const Listing& listing);
+bool write_shard(const string& title, time_t when, vector<Listing>& queue);
+int merge_shards(const vector<string>& files, map<string,string>& config);
+vector<const Listing*> in_viewport(const vector<const Listing*>& listings);
+int query_state(map<string,string>& config);
+int query_store(map<string,string>& config);
+time_t parse_time(const char* str);
+bool load_state(const char* filename);
+bool save_state(const char* filename);
+bool is_cached(const Listing& listing);
+bool job_is_cached(const ListingJob* job);
+bool time_is_up(double needed);
+void start_deadline(int writes);
+void reset_worker_arenas();
+void request_stop(int sig);
 
 // -----------------------------------------
 int main (int argc, char* argv[])
@@ -40,147 +145,1015 @@ int main (int argc, char* argv[])
 
 	// Parse command line options.
 	parse_args(argc, argv);
+	
+	// Metrics are written however we exit.
+	if(metricsbase!=NULL)
+	{
+		Metrics::enabled = true;
+		atexit(write_metrics);
+	}
+	Metrics::Timer runTimer("run");
+	
+	// Stop early, but still write what we have, if we are asked to quit.
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+
+	// Parse the config file if it exists.
+	if(configfilename!=NULL)
+	{
+		load_config_file(configfilename, config);
+	}
+	
+	// Putting shards together doesn't need a URL
+	if(!mergeFiles.empty())
+	{
+		vector<string> files(mergeFiles.begin(), mergeFiles.end());
+		return merge_shards(files, config);
+	}
+	
+	// Nor does looking up the listings we already have
+	if(url==NULL && viewportSet && statefilepath!=NULL)
+	{
+		return query_state(config);
+	}
+	if(fromstorepath!=NULL)
+	{
+		return query_store(config);
+	}
 
 	// We can't do anything without a URL
 	if(url==NULL)
 	{
-		help();
+		help();
+		return 1;
+	}
+	if((shardCount>0 || localShards>0) && outfilepath==NULL)
+	{
+		cerr << "ERROR: shards have to be written to a file (-o)" << endl;
+		return 1;
+	}
+	
+	if(!descriptionFormat.setMode(config["description_mode"]))
+	{
+		cerr << "ERROR: description_mode must be full, html, text or summary" << endl;
+		return 1;
+	}
+	descriptionFormat.maxBytes = atoi(config["description_max_bytes"].c_str());
+	descriptionFormat.summaryBytes = atoi(config["description_summary_bytes"].c_str());
+	
+	// Make sure we have a Craigslist URL
+	pcrecpp::RE re(config["acceptable_url_re"]);
+	if(!re.FullMatch(url))
+	{
+		cerr << "ERROR: URL is not acceptable" << endl;
+		return 1;
+	}
+	
+	// Set the user agent and cache directory for all Webpage operations
+	Webpage::userAgent = config["user_agent"];
+	if(cachedir!=NULL) Webpage::cacheDirectory = cachedir;
+	
+	// Split the work between local worker processes and merge what they write.
+	// This has to happen before there are any threads.
+	if(localShards>0)
+	{
+		int result = run_shards(config);
+		if(shardIndex<0) return result;
+	}
+	
+	if(gazetteerpath!=NULL && !gazetteer.open(gazetteerpath))
+	{
+		return 1;
+	}
+	
+	// libxml and libcurl have to be set up before there are threads.
+	Webpage::init();
+	network = new WorkerPool(connections);
+	cpu = new WorkerPool(cpuThreads);
+	if(network->size()==0 || cpu->size()==0)
+	{
+		cerr << "ERROR: couldn't start threads" << endl;
+		return 1;
+	}
+	for(int i=0; i<cpu->size(); i++)
+	{
+		workerArenas.push_back(new Arena());
+	}
+	if(verbose)
+		cerr << "Using " << network->size() << " connections and " << cpu->size() << " CPU threads" << endl;
+	
+	// Pick up where the last run left off
+	if(statefilepath!=NULL)
+	{
+		load_state(statefilepath);
+	}
+	
+	int result = crawl(config);
+	reset_worker_arenas();
+	
+	// In watch mode, keep polling until we are told to stop.
+	while(watchInterval>0 && !stopRequested)
+	{
+		if(verbose)
+			cerr << "Waiting " << watchInterval << " seconds" << endl;
+		
+		double wakeup = Metrics::now() + watchInterval;
+		while(!stopRequested && Metrics::now() < wakeup)
+		{
+			usleep(100000);
+		}
+		if(!stopRequested)
+		{
+			result = crawl(config);
+			reset_worker_arenas();
+		}
+	}
+	
+	// CPU workers hand jobs to the network pool, so they go first.
+	delete cpu;
+	delete network;
+	
+	// Shutdown libxml
+    xmlCleanupParser();
+	
+	if(result!=0)
+		return result;
+	
+	cerr << "DONE" << endl;
+	return 0;
+}
+
+
+// -----------------------------------------
+// Fetch the search page, process every listing on it that we haven't
+// seen before and write the output.
+int crawl(map<string,string>& config)
+{
+	// Local shards were given theirs by run_shards, before it fetched the
+	// search page.
+	if(deadlineSeconds>0 && localShards==0)
+	{
+		start_deadline(1);
+	}
+	
+	if(verbose) 
+		cerr << "opening " << truncate(url) << endl;
+	
+	
+	// The links point into listingsPage, so it has to outlive the queue.
+	Webpage listingsPage;
+	vector<Link> links;
+	try {
+		// Open the main page
+		listingsPage.setVerbose(verbose);
+		bool opened = searchPage.empty() ? listingsPage.open(url, false, false) : listingsPage.load(searchPage);
+		if(!opened) 
+		{
+			cerr << "ERROR: couldn't open main listing page!" << endl;
+			return 1;
+		}
+		
+		// Get the links from the main listings page.
+		links = listingsPage.getLinks(config["craigslist_links"]);
+		if(verbose)
+			cerr << "Retrieved " << links.size() << " links" << endl;
+	} catch (std::logic_error& e) {
+		cerr << "ERROR: " << e.what() << endl;
+		return 1;
+	}
+
+	string title = listingsPage.getNodeContents("//title").str();
+	time_t when = searchPage.empty() ? time(0) : searchPageTime;
+	
+	// The queue stays in link order, which is the order of the output.
+	vector<Listing> queue;
+	queue.reserve(min((int)links.size(), maxListings));
+	for(size_t i=0; i<links.size() && ((int)queue.size()<maxListings); ++i)
+	{
+		queue.push_back(Listing(links[i].title, links[i].href));
+	}
+	
+	// Everything we haven't seen before goes through the stages.
+	vector<ListingJob*> jobs;
+	for(size_t i=0; i<queue.size(); i++)
+	{
+		Listing& listing = queue[i];
+		
+		// A shard worker only does its own share.
+		if(!in_shard(listing))
+			continue;
+		
+		// Nothing to do if we already have it.
+		map<StringRef,Listing>::iterator known = seen.find(listing.id);
+		if(known != seen.end())
+		{
+			listing = known->second;
+			Metrics::count("listings_seen");
+			continue;
+		}
+		
+		ListingJob* job = new ListingJob;
+		job->listing = &listing;
+		job->config = &config;
+		job->page = NULL;
+		job->index = i;
+		job->total = queue.size();
+		job->start = 0;
+		jobs.push_back(job);
+	}
+	
+	// Decide what order to work in.  When we are racing a deadline, the
+	// listings that are already cached cost almost nothing, so do them first.
+	if(deadline>0 && !Webpage::cacheDirectory.empty())
+		stable_partition(jobs.begin(), jobs.end(), job_is_cached);
+	
+	// The network threads take listings in this order.
+	pthread_mutex_lock(&jobsMutex);
+	fetchQueue = jobs;
+	nextFetch = 0;
+	geocodeQueue.clear();
+	jobsRemaining = jobs.size();
+	jobsFinished = 0;
+	averageListing = 0;
+	pthread_mutex_unlock(&jobsMutex);
+	
+	for(int i=0; i<network->size() && i<(int)jobs.size(); i++)
+	{
+		network->submit(fetch_listings, NULL);
+	}
+	
+	pthread_mutex_lock(&jobsMutex);
+	while(jobsRemaining > 0)
+		pthread_cond_wait(&jobsDone, &jobsMutex);
+	pthread_mutex_unlock(&jobsMutex);
+	network->wait();
+	
+	// Only the main thread touches 'seen' and the run arena.
+	int processed=0;
+	vector<const Listing*> toStore;
+	for(size_t i=0; i<jobs.size(); i++)
+	{
+		Listing& listing = *jobs[i]->listing;
+		delete jobs[i];
+		
+		if(listing.status==Listing::UNPROCESSED)
+		{
+			Metrics::count("listings_unprocessed");
+			continue;
+		}
+		
+		Metrics::count(listing.status==Listing::MAPPABLE ? "listings_mappable" : "listings_unmappable");
+		
+		// The title and URL still point into listingsPage, and the
+		// description into a worker arena.
+		listing.title = arena.copy(listing.title);
+		listing.url = arena.copy(listing.url);
+		listing.description = arena.copy(listing.description);
+		listing.id = Listing::postingId(listing.url);
+		listing.found = when;
+		seen[listing.id] = listing;
+		toStore.push_back(&listing);
+		processed++;
+	}
+	
+	if(storepath!=NULL && !toStore.empty())
+	{
+		Metrics::Timer storeTimer("store_append");
+		if(ListingStore::append(storepath, toStore))
+			Metrics::count("store_rows_appended", toStore.size());
+	}
+	
+	if(statefilepath!=NULL && processed>0)
+	{
+		save_state(statefilepath);
+	}
+	
+	if(shardCount>0)
+	{
+		return write_shard(title, when, queue) ? 0 : 1;
+	}
+	
+	// The document is rebuilt from everything on the page, old and new.
+	// A viewport takes from everything we have ever seen instead.
+	Craig2KML c2k(title, verbose, when);
+	c2k.setBalloonTemplate(config["description_template"]=="yes" && descriptionFormat.mode!=Description::FULL);
+	if(viewportSet)
+	{
+		vector<const Listing*> known;
+		for(map<StringRef,Listing>::iterator it=seen.begin(); it!=seen.end(); ++it)
+			known.push_back(&it->second);
+		
+		vector<const Listing*> inside = in_viewport(known);
+		for(size_t i=0; i<inside.size(); i++)
+			c2k.add(*inside[i]);
+	}
+	else
+	{
+		for(size_t i=0; i<queue.size(); i++)
+			c2k.add(queue[i]);
+	}
+	
+	return write_output(c2k) ? 0 : 1;
+}
+
+
+// -----------------------------------------
+// Runs on a network thread.  Downloads listing pages in queue order until
+// there are none left, finishing any geocoding that is waiting first.
+void fetch_listings(void* arg)
+{
+	while(true)
+	{
+		geocode_next(NULL);
+		
+		pthread_mutex_lock(&jobsMutex);
+		ListingJob* job = nextFetch < fetchQueue.size() ? fetchQueue[nextFetch++] : NULL;
+		double needed = averageListing;
+		pthread_mutex_unlock(&jobsMutex);
+		if(job==NULL) break;
+		
+		// Don't start anything we can't expect to finish.
+		if(time_is_up(needed))
+		{
+			if(verbose) 
+				cerr << "Out of time. Skipping " << job->index << " out of " << job->total << ": " << job->listing->title << endl;
+			job->listing->status = Listing::UNPROCESSED;
+			finish_listing(job);
+			continue;
+		}
+		fetch_listing(job);
+	}
+}
+
+
+// -----------------------------------------
+void fetch_listing(ListingJob* job)
+{
+	Listing& listing = *job->listing;
+	if(verbose) 
+		cerr << "Parsing " << job->index << " out of " << job->total << ": " << listing.title << endl;
+	
+	job->start = Metrics::now();
+	listing.status = Listing::UNMAPPABLE;
+	job->page = new Webpage();
+	job->page->setVerbose(verbose);
+	if(!job->page->fetch(listing.url.str(), true))
+	{
+		if(verbose) cerr << "Couldn't open page. Trying again next time." << endl;
+		failed_listing(job);
+		return;
+	}
+	cpu->submit(extract_listing, job);
+}
+
+
+// -----------------------------------------
+// Runs on a CPU thread.  Fill in the description and, if the gazetteer
+// knows the address, the location of one listing.
+void extract_listing(void* arg)
+{
+	ListingJob* job = (ListingJob*)arg;
+	Listing& listing = *job->listing;
+	map<string,string>& config = *job->config;
+	Webpage& page = *job->page;
+	
+	if(!page.prepare(false))
+	{
+		if(verbose) cerr << "Couldn't parse page. Unmappable." << endl;
+		finish_listing(job);
+		return;
+	}
+	
+	StringRef href = page.getNodeAttribute(config["craigslist_google_maps_link"], "href");
+	size_t prefix = min(href.length, config["craigslist_google_maps_link_prefix"].length());
+	job->addr.assign(href.data+prefix, href.length-prefix);
+	
+	listing.description = page.getNodeDescription(config["craigslist_item_description"], descriptionFormat, listing.url.str(), workerArenas[cpu->currentWorker()]);
+	Metrics::count("description_bytes", listing.description.length);
+	delete job->page;
+	job->page = NULL;
+	
+	if(job->addr.empty())
+	{
+		if(verbose) cerr << "No address found. Unmappable." << endl;
+		finish_listing(job);
+		return;
+	}
+	
+	// The local gazetteer is much faster than the geocoding service, when it knows the address.
+	if(gazetteer.isOpen())
+	{
+		Metrics::Timer gazetteerTimer("gazetteer");
+		if(gazetteer.lookup(job->addr, listing.lat, listing.lng))
+		{
+			Metrics::count("gazetteer_hits");
+			listing.status = Listing::MAPPABLE;
+			if(verbose) 
+				cerr << "Found in gazetteer. Adding placemark at " << listing.lat << ", " << listing.lng << endl;
+			finish_listing(job);
+			return;
+		}
+		Metrics::count("gazetteer_misses");
+	}
+	
+	// Hand it back to the network threads.  Whichever gets to it first does
+	// it.  The submit happens under the lock: once it is released the job
+	// can finish, the crawl can end and 'network' can be gone.
+	pthread_mutex_lock(&jobsMutex);
+	geocodeQueue.push_back(job);
+	network->submit(geocode_next, NULL);
+	pthread_mutex_unlock(&jobsMutex);
+}
+
+
+// -----------------------------------------
+// Runs on a network thread.  Geocodes one waiting listing, if there is one.
+void geocode_next(void* arg)
+{
+	pthread_mutex_lock(&jobsMutex);
+	ListingJob* job = NULL;
+	if(!geocodeQueue.empty())
+	{
+		job = geocodeQueue.front();
+		geocodeQueue.pop_front();
+	}
+	pthread_mutex_unlock(&jobsMutex);
+	
+	if(job) geocode_listing(job);
+}
+
+
+// -----------------------------------------
+void geocode_listing(ListingJob* job)
+{
+	Listing& listing = *job->listing;
+	string geocodeURL = (*job->config)["geocoder_url"]+job->addr;
+	if(verbose) 
+		cerr << "calling " << geocodeURL << endl;
+	
+	// The geocoder's answer is a few hundred bytes of XML, so it is
+	// parsed right here rather than handed to the CPU threads.
+	Metrics::Timer geocodeTimer("geocode");
+	Webpage geocode;
+	geocode.setVerbose(verbose);
+	if(!geocode.open(geocodeURL, true, true))
+	{
+		if(verbose) cerr << "Can't reach geocoding service. Trying again next time." << endl;
+		failed_listing(job);
+		return;
+	}
+	
+	// Only ZERO_RESULTS means the address can't be found.  Anything else
+	// (OVER_QUERY_LIMIT, REQUEST_DENIED, UNKNOWN_ERROR) may work next time.
+	StringRef status = geocode.getNodeContents("/GeocodeResponse/status");
+	if(status == "ZERO_RESULTS")
+	{
+		if(verbose) cerr << "Geocoder doesn't know the address. Unmappable." << endl;
+		finish_listing(job);
+		return;
+	}
+	if(status != "OK")
+	{
+		if(verbose) cerr << "Geocode failed (" << status << "). Trying again next time." << endl;
+		failed_listing(job);
+		return;
+	}
+	
+	listing.lat = atof(geocode.getNodeContents("/GeocodeResponse/result/geometry/location/lat").data);
+	listing.lng = atof(geocode.getNodeContents("/GeocodeResponse/result/geometry/location/lng").data);
+	listing.status = Listing::MAPPABLE;
+	
+	if(verbose) 
+		cerr << "Adding placemark at " << listing.lat << ", " << listing.lng << endl;
+	finish_listing(job);
+}
+
+
+// -----------------------------------------
+// Something went wrong that may not go wrong next time (the network, the
+// geocoder's rate limit).  The listing is left unprocessed, so it doesn't
+// go into 'seen' or the state file and the next crawl tries it again.
+void failed_listing(ListingJob* job)
+{
+	Metrics::count("listings_failed");
+	job->listing->status = Listing::UNPROCESSED;
+	finish_listing(job);
+}
+
+
+// -----------------------------------------
+// Every job ends up here exactly once, whatever happened to it.
+void finish_listing(ListingJob* job)
+{
+	Listing& listing = *job->listing;
+	delete job->page;
+	job->page = NULL;
+	
+	// If a request was cut off by the deadline, the listing wasn't really tried.
+	if(listing.status==Listing::UNMAPPABLE && time_is_up(0))
+	{
+		listing.status = Listing::UNPROCESSED;
+	}
+	
+	pthread_mutex_lock(&jobsMutex);
+	if(job->start > 0)
+	{
+		double elapsed = Metrics::now() - job->start;
+		Metrics::observe("listing", elapsed);
+		averageListing = (averageListing*jobsFinished + elapsed) / (jobsFinished+1);
+		jobsFinished++;
+	}
+	if(--jobsRemaining == 0)
+		pthread_cond_signal(&jobsDone);
+	pthread_mutex_unlock(&jobsMutex);
+}
+
+
+// -----------------------------------------
+bool write_output(Craig2KML& c2k)
+{
+	// Decide where to put the output.  A file is written under a temporary
+	// name and moved into place, so nobody ever sees half of one.
+	string partfilepath;
+	std::ofstream realOutFile;
+	if(outfilepath!=NULL)
+	{
+		partfilepath = string(outfilepath);
+		if(can_replace(outfilepath))
+			partfilepath += ".part";
+		realOutFile.open(partfilepath.c_str(), std::ios::out);
+		if(!realOutFile.is_open())
+		{
+			cerr << "ERROR: couldn't write " << partfilepath << endl;
+			return false;
+		}
+	}
+	std::ostream & outFile = (realOutFile.is_open() ? realOutFile : std::cout);
+	
+	// Send the serialized file to whatever output we have set.
+	Metrics::Timer serializeTimer("serialize");
+	string kml = c2k.serialize();
+	serializeTimer.stop();
+	outFile << kml;
+	outFile.flush();
+	Metrics::count("bytes_written", kml.length());
+	
+	if(realOutFile.is_open())
+	{
+		realOutFile.close();
+		if(partfilepath!=outfilepath && rename(partfilepath.c_str(), outfilepath)!=0)
+		{
+			cerr << "ERROR: couldn't write " << outfilepath << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// -----------------------------------------
+// Only a regular file, or one that isn't there yet, can be replaced by
+// renaming a temporary file over it.  Anything else (/dev/null, a pipe)
+// is written to directly.
+bool can_replace(const char* path)
+{
+	struct stat st;
+	if(stat(path, &st)!=0)
+		return errno==ENOENT;
+	return S_ISREG(st.st_mode);
+}
+
+
+// -----------------------------------------
+// Fork one worker process per shard.  In a worker this returns straight
+// away with shardIndex set, and the worker goes on to crawl its share.
+// The coordinator waits for them all and merges their shards.
+int run_shards(map<string,string>& config)
+{
+	if(watchInterval>0)
+	{
+		cerr << "ERROR: --shards can't be used with --watch" << endl;
+		return 1;
+	}
+	
+	// The worker's own file names have to outlive this function.
+	static string shardfile, shardstate, shardmetrics;
+	
+	// The clock starts now, for the workers too.  They leave time for
+	// writing their shards and for merging them.
+	if(deadlineSeconds>0)
+	{
+		start_deadline(2);
+	}
+	
+	Webpage::init();
+	searchPage = Webpage::download(url, verbose);
+	searchPageTime = time(0);
+	if(searchPage.empty())
+	{
+		cerr << "ERROR: couldn't open main listing page!" << endl;
+		return 1;
+	}
+	
+	vector<string> files;
+	int failures=0;
+	for(int i=0; i<localShards; i++)
+	{
+		char suffix[32];
+		sprintf(suffix, ".shard-%d", i);
+		files.push_back(string(outfilepath)+suffix);
+		
+		pid_t pid = fork();
+		if(pid==0)
+		{
+			shardIndex = i;
+			shardCount = localShards;
+			shardfile = files.back();
+			outfilepath = shardfile.c_str();
+			if(statefilepath!=NULL)
+			{
+				shardstate = string(statefilepath)+suffix;
+				statefilepath = shardstate.c_str();
+			}
+			if(metricsbase!=NULL)
+			{
+				shardmetrics = string(metricsbase)+suffix;
+				metricsbase = shardmetrics.c_str();
+				
+				// Fetching the search page is in the parent's metrics
+				Metrics::reset();
+			}
+			return 0;
+		}
+		if(pid<0)
+		{
+			cerr << "ERROR: couldn't start shard " << i << endl;
+			failures++;
+		}
+	}
+	
+	int status;
+	pid_t pid;
+	while((pid = wait(&status)) > 0 || (pid<0 && errno==EINTR))
+	{
+		if(pid>0 && (!WIFEXITED(status) || WEXITSTATUS(status)!=0))
+			failures++;
+	}
+	if(failures>0)
+	{
+		cerr << "ERROR: " << failures << " of " << localShards << " shards failed" << endl;
+		return 1;
+	}
+	
+	int result = merge_shards(files, config);
+	if(result==0)
+	{
+		for(size_t i=0; i<files.size(); i++)
+			unlink(files[i].c_str());
+	}
+	return result;
+}
+
+
+// -----------------------------------------
+// Listings are split between shards by a hash of their URL.  It has to be
+// the same on every machine, so it is spelled out here (32 bit FNV-1a).
+bool in_shard(const Listing& listing)
+{
+	if(shardCount<=0) return true;
+	
+	unsigned int hash = fnv1a(listing.url.data, listing.url.length);
+	return (int)(hash % shardCount) == shardIndex;
+}
+
+
+// -----------------------------------------
+// Pass the last result back in as 'hash' to keep hashing more bytes.
+unsigned int fnv1a(const char* data, size_t length, unsigned int hash)
+{
+	for(size_t i=0; i<length; i++)
+	{
+		hash ^= (unsigned char)data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+
+// -----------------------------------------
+// A shard file is a header line, then one line for each of the shard's
+// listings: its position on the search page and the listing as a state
+// file has it.  The header says how many listings the search page had
+// and has a hash of their URLs in order, so shards made from different
+// versions of the page can't be merged.
+bool write_shard(const string& title, time_t when, vector<Listing>& queue)
+{
+	string partfilepath = string(outfilepath);
+	if(can_replace(outfilepath))
+		partfilepath += ".part";
+	ofstream shardfile(partfilepath.c_str(), ios::out);
+	if(!shardfile.is_open())
+	{
+		cerr << "ERROR: couldn't write " << partfilepath << endl;
+		return false;
+	}
+	
+	string cleanTitle = title;
+	replace(cleanTitle.begin(), cleanTitle.end(), '\t', ' ');
+	replace(cleanTitle.begin(), cleanTitle.end(), '\n', ' ');
+	unsigned int pageHash = fnv1a("", 0);
+	for(size_t i=0; i<queue.size(); i++)
+	{
+		pageHash = fnv1a(queue[i].url.data, queue[i].url.length, pageHash);
+		pageHash = fnv1a("\n", 1, pageHash);
+	}
+	
+	char page[32];
+	sprintf(page, "%lu\t%08x", (unsigned long)queue.size(), pageHash);
+	shardfile << "#craig2kml-shard\t" << shardIndex << "\t" << shardCount << "\t" << (long)when << "\t" << page << "\t" << cleanTitle << "\n";
+	for(size_t i=0; i<queue.size(); i++)
+	{
+		if(in_shard(queue[i]))
+			shardfile << i << "\t" << queue[i].serialize() << "\n";
+	}
+	shardfile.close();
+	
+	if(partfilepath!=outfilepath && rename(partfilepath.c_str(), outfilepath)!=0)
+	{
+		cerr << "ERROR: couldn't write " << outfilepath << endl;
+		return false;
+	}
+	return true;
+}
+
+
+// -----------------------------------------
+// Put the listings from every shard back in search page order and write
+// the same document a single process would have.
+int merge_shards(const vector<string>& files, map<string,string>& config)
+{
+	map<size_t,Listing> listings;
+	vector<bool> found;
+	string title;
+	time_t when=0;
+	unsigned long pageListings=0;
+	unsigned int pageHash=0;
+	
+	for(size_t f=0; f<files.size(); f++)
+	{
+		ifstream shardfile(files[f].c_str());
+		string line;
+		if(!shardfile.is_open() || !getline(shardfile, line))
+		{
+			cerr << "ERROR: couldn't read shard " << files[f] << endl;
+			return 1;
+		}
+		
+		// The header: #craig2kml-shard index count time listings hash title
+		istringstream header(line);
+		string magic, shardTitle;
+		int index=-1, count=0;
+		long shardWhen=0;
+		unsigned long shardListings=0;
+		unsigned int shardHash=0;
+		getline(header, magic, '\t');
+		header >> index >> count >> shardWhen >> shardListings >> hex >> shardHash >> dec;
+		header.get();
+		getline(header, shardTitle);
+		if(magic!="#craig2kml-shard" || header.fail() || count<=0 || index<0 || index>=count)
+		{
+			cerr << "ERROR: " << files[f] << " is not a shard" << endl;
+			return 1;
+		}
+		if(found.empty())
+		{
+			found.resize(count, false);
+			pageListings = shardListings;
+			pageHash = shardHash;
+		}
+		if(count!=(int)found.size() || found[index])
+		{
+			cerr << "ERROR: " << files[f] << " doesn't fit with the other shards" << endl;
+			return 1;
+		}
+		if(shardListings!=pageListings || shardHash!=pageHash)
+		{
+			cerr << "ERROR: " << files[f] << " was made from a different search page than " << files[0]
+				<< " (the page changed between the runs)" << endl;
+			return 1;
+		}
+		found[index] = true;
+		
+		if(index==0) title = shardTitle;
+		if(when==0 || (shardWhen>0 && shardWhen<when)) when = shardWhen;
+		
+		while(getline(shardfile, line))
+		{
+			size_t tab = line.find('\t');
+			Listing listing;
+			if(tab==string::npos || !listing.unserialize(line.substr(tab+1), arena))
+			{
+				cerr << "ERROR: bad line in " << files[f] << endl;
+				return 1;
+			}
+			size_t position = strtoul(line.c_str(), NULL, 10);
+			if(position>=pageListings)
+			{
+				cerr << "ERROR: bad line in " << files[f] << endl;
+				return 1;
+			}
+			if(listings.find(position)!=listings.end())
+			{
+				cerr << "ERROR: listing " << position << " is in more than one shard" << endl;
+				return 1;
+			}
+			listings[position] = listing;
+		}
+	}
+	
+	for(size_t i=0; i<found.size(); i++)
+	{
+		if(!found[i])
+		{
+			cerr << "ERROR: shard " << i << " of " << found.size() << " is missing" << endl;
+			return 1;
+		}
+	}
+	if(listings.size()!=pageListings)
+	{
+		cerr << "ERROR: the shards have " << listings.size() << " of the " << pageListings << " listings on the search page" << endl;
 		return 1;
 	}
+	if(verbose)
+		cerr << "Merging " << listings.size() << " listings from " << found.size() << " shards" << endl;
 	
-	// Parse the config file if it exists.
-	if(configfilename!=NULL)
+	Metrics::Timer mergeTimer("merge");
+	Craig2KML c2k(title, verbose, when);
+	c2k.setBalloonTemplate(config["description_template"]=="yes" && config["description_mode"]!="full");
+	if(viewportSet)
 	{
-		load_config_file(configfilename, config);
+		vector<const Listing*> merged;
+		for(map<size_t,Listing>::iterator it=listings.begin(); it!=listings.end(); ++it)
+			merged.push_back(&it->second);
+		
+		vector<const Listing*> inside = in_viewport(merged);
+		for(size_t i=0; i<inside.size(); i++)
+			c2k.add(*inside[i]);
 	}
+	else
+	{
+		for(map<size_t,Listing>::iterator it=listings.begin(); it!=listings.end(); ++it)
+			c2k.add(it->second);
+	}
+	mergeTimer.stop();
+	
+	return write_output(c2k) ? 0 : 1;
+}
+
 
+// -----------------------------------------
+// The mappable listings inside the viewport, most recent first, and no
+// more than --top of them.
+vector<const Listing*> in_viewport(const vector<const Listing*>& listings)
+{
+	Metrics::Timer queryTimer("viewport_query");
+	vector<const Listing*> inside = Listing::newestInside(listings, viewport, topListings);
+	queryTimer.stop();
 	
-	// Make sure we have a Craigslist URL
-	pcrecpp::RE re(config["acceptable_url_re"]);
-	if(!re.FullMatch(url))
+	if(verbose)
+		cerr << inside.size() << " of " << listings.size() << " listings are in the viewport" << endl;
+	return inside;
+}
+
+
+// -----------------------------------------
+// Write the listings in the state file that are inside the viewport,
+// without going to craigslist at all.
+int query_state(map<string,string>& config)
+{
+	if(!load_state(statefilepath))
 	{
-		cerr << "ERROR: URL is not acceptable" << endl;
+		cerr << "ERROR: couldn't read state from " << statefilepath << endl;
 		return 1;
 	}
 	
-	// Set the user agent and cache directory for all Webpage operations
-	Webpage::userAgent = config["user_agent"];
-	if(cachedir!=NULL) Webpage::cacheDirectory = cachedir;
-	
-	if(verbose) 
-		cerr << "opening " << truncate(url) << endl;
+	vector<const Listing*> known;
+	for(map<StringRef,Listing>::iterator it=seen.begin(); it!=seen.end(); ++it)
+		known.push_back(&it->second);
 	
+	Craig2KML c2k("Listings in viewport", verbose);
+	c2k.setBalloonTemplate(config["description_template"]=="yes" && config["description_mode"]!="full");
+	vector<const Listing*> inside = in_viewport(known);
+	for(size_t i=0; i<inside.size(); i++)
+		c2k.add(*inside[i]);
 	
-	Webpage listingsPage;
-	map<string,string> links;
-	try {
-		// Open the main page
-		listingsPage.setVerbose(verbose);
-		bool opened = listingsPage.open(url, false, false);
-		if(!opened) 
-		{
-			cerr << "ERROR: couldn't open main listing page!" << endl;
-			return 1;
-		}
-		
-		// Get the links from the main listings page.
-		links = listingsPage.getLinks(config["craigslist_links"]);
-		if(verbose)
-			cerr << "Retrieved " << links.size() << " links" << endl;
-	} catch (std::logic_error& e) {
-		cerr << "ERROR: " << e.what() << endl;
+	return write_output(c2k) ? 0 : 1;
+}
+
+
+// -----------------------------------------
+// Write the listings in the store that pass the filters, most recent
+// first, without fetching or parsing anything.
+int query_store(map<string,string>& config)
+{
+	ListingStore store;
+	if(!store.open(fromstorepath))
+	{
 		return 1;
 	}
-
-	// Create the document we will be outputting
-	Craig2KML c2k(listingsPage.getNodeContents("//title"), verbose);
-	
-		
-	// Loop through all of the links on the page.
-	int i=0;
-	for(map<string,string>::iterator it=links.begin(); it!=links.end() && (i<maxListings); ++it)
+	if(viewportSet)
 	{
-		// TO DO:  Both of these varnames already exist in a higher scope!
-		string title = it->first;
-		string url = it->second;
-		string description;
-		if(verbose) 
-			cerr << "Parsing " << i++ << " out of " << links.size() << ": " << title << endl;
-
-		bool mappable=true;
-
-		
-		Webpage listing;
-		listing.setVerbose(verbose);
-		if(listing.open(url, false, true))
-		{
-			string addr = listing.getNodeAttribute(config["craigslist_google_maps_link"], "href");
-			addr.erase(0, config["craigslist_google_maps_link_prefix"].length());
-			
-			description = listing.getNodeAsString(config["craigslist_item_description"]);
-			
-			if(!addr.empty())
-			{
-				string geocodeURL = "http://maps.googleapis.com/maps/api/geocode/xml?sensor=false&address="+addr;
-				if(verbose) 
-					cerr << "calling " << geocodeURL << endl;
-				
-				Webpage geocode;
-				geocode.setVerbose(verbose);
-				if(geocode.open(geocodeURL, true, true))
-				{
-					const char* status = geocode.getNodeContents("/GeocodeResponse/status");
-					if(strcmp(status, "OK")==0)
-					{
-						float lat = atof(geocode.getNodeContents("/GeocodeResponse/result/geometry/location/lat"));
-						float lng = atof(geocode.getNodeContents("/GeocodeResponse/result/geometry/location/lng"));
-						
-						if(verbose) 
-							cerr << "Adding placemark at " << lat << ", " << lng << endl;
-
-						c2k.addMappable(title, description, lat, lng);
-					}
-					else {
-						if(verbose) cerr << "Geocode failed. Unmappable." << endl;
-						mappable=false;
-					}
-				} else {
-					if(verbose) cerr << "Can't reach geocoding service. Unmappable." << endl;
-					mappable=false;
-				}
-			} else {
-				if(verbose) cerr << "No address found. Unmappable." << endl;
-				mappable=false;
-			}
-		} else {
-			if(verbose) cerr << "Couldn't open page. Unmappable." << endl;
-			mappable=false;
-		}
-
-		if(!mappable) {
-			c2k.addUnmappable(title, description);
-		}
+		storeFilter.areaSet = true;
+		storeFilter.area = viewport;
 	}
 	
+	Metrics::Timer queryTimer("store_query");
+	vector<Listing> selected = store.select(storeFilter);
+	vector<const Listing*> newest;
+	for(size_t i=0; i<selected.size(); i++)
+		newest.push_back(&selected[i]);
+	sort(newest.begin(), newest.end(), Listing::moreRecent);
+	if(topListings>0 && (int)newest.size()>topListings)
+		newest.resize(topListings);
+	queryTimer.stop();
 	
-	// Decide where to put the output
-	std::ofstream realOutFile;
-	if(outfilepath!=NULL)
-		realOutFile.open(outfilepath, std::ios::out);
-	std::ostream & outFile = (realOutFile.is_open() ? realOutFile : std::cout);
+	if(verbose)
+		cerr << newest.size() << " of " << store.size() << " stored listings match" << endl;
 	
-	// Send the serialized file to whatever output we have set.
-	outFile << c2k.serialize();
+	Craig2KML c2k("Listings from " + string(fromstorepath), verbose);
+	c2k.setBalloonTemplate(config["description_template"]=="yes" && config["description_mode"]!="full");
+	for(size_t i=0; i<newest.size(); i++)
+		c2k.add(*newest[i]);
 	
-	// Shutdown libxml
-    xmlCleanupParser();
+	return write_output(c2k) ? 0 : 1;
+}
+
+
+// -----------------------------------------
+// Seconds since 1970, or how long ago with a unit: 90m, 12h, 3d.  -1 if
+// it is neither.
+time_t parse_time(const char* str)
+{
+	char* end;
+	double value = strtod(str, &end);
+	if(end == str || value < 0)
+		return -1;
 	
+	double unit = 0;
+	if(*end == 'm')			unit = 60;
+	else if(*end == 'h')	unit = 3600;
+	else if(*end == 'd')	unit = 86400;
+	else if(*end == '\0')	return (time_t)value;
+	else return -1;
 	
-	cerr << "DONE" << endl;
-	return 0;
+	if(end[1] != '\0')
+		return -1;
+	return time(0) - (time_t)(value*unit);
 }
 
 
+// -----------------------------------------
+bool load_state(const char* filename)
+{
+	ifstream statefile(filename);
+	if(!statefile.is_open())
+	{
+		if(verbose) cerr << "No state file yet: " << filename << endl;
+		return false;
+	}
+	
+	string line;
+	while(getline(statefile, line))
+	{
+		Listing listing;
+		if(listing.unserialize(line, arena))
+			seen[listing.id] = listing;
+	}
+	if(verbose) 
+		cerr << "Loaded " << seen.size() << " listings from " << filename << endl;
+	return true;
+}
+
+
+// -----------------------------------------
+bool save_state(const char* filename)
+{
+	string partfilename = string(filename)+".part";
+	ofstream statefile(partfilename.c_str(), ios::out);
+	if(!statefile.is_open())
+	{
+		cerr << "ERROR: couldn't write state to " << partfilename << endl;
+		return false;
+	}
+	
+	for(map<StringRef,Listing>::iterator it=seen.begin(); it!=seen.end(); ++it)
+	{
+		statefile << it->second.serialize() << "\n";
+	}
+	statefile.close();
+	return rename(partfilename.c_str(), filename)==0;
+}
+
 
 // -----------------------------------------
 void help()
@@ -188,15 +1161,44 @@ void help()
 	cerr << endl;
 	cerr << "typical: (-u|--url ) #### [(-o|--outfile) ####]" << endl;
 	cerr << "  where:" << endl;
+	cerr << "  --bbox west,south,east,north only include mappable listings inside this" << endl;
+	cerr << "     box, most recent first, out of every listing seen so far (see -s)." << endl;
+	cerr << "     With a state file and no URL, nothing is crawled." << endl;
 	cerr << "  -c (--config) use custom config values" << endl;
 	cerr << "  -d (--cachedir) the directory in which to load and save cache files" << endl;
+	cerr << "  --from-store <store> write listings from a store (see --store) instead of" << endl;
+	cerr << "     crawling.  Filter them with --since, --until, --bbox, --keyword, --price" << endl;
+	cerr << "     and --top." << endl;
+	cerr << "  --deadline number of seconds to spend.  Listings that can't be done" << endl;
+	cerr << "     in time are put in an Unprocessed Listings folder." << endl;
+	cerr << "  -g (--gazetteer) geocode from this index before using the geocoding service" << endl;
+	cerr << "  --build-gazetteer <csv> <index> make a gazetteer index from an address" << endl;
+	cerr << "     point CSV with LON, LAT, NUMBER, STREET, CITY and REGION columns" << endl;
 	cerr << "  -h (--help) print a help message" << endl;
+	cerr << "  --keyword word: only stored listings with this in their title or description" << endl;
+	cerr << "  --hedge fraction: resend requests that are slower than their host's p95," << endl;
+	cerr << "     but never more than this fraction of all requests (e.g. 0.05)" << endl;
+	cerr << "  -j (--jobs) number of threads for parsing (default: one per core)" << endl;
+	cerr << "  --connections number of downloads to run at once (default 4)" << endl;
 	cerr << "  -m (--max) maximum number of listings to include" << endl;
+	cerr << "  --merge <shard files> put shards back together into one KML file (-o)" << endl;
+	cerr << "  --metrics write timings and counters to <base>.json and <base>.prom" << endl;
+	cerr << "  --price min,max only stored listings asking this much (0 for no limit)" << endl;
 	cerr << "  -o (--outfile) is the file in which the kml will be saved" << endl;
 	cerr << "     prints to stdout if no file is provided." << endl;
+	cerr << "  -s (--state) file that remembers every listing already processed," << endl;
+	cerr << "     so that only new ones are fetched." << endl;
+	cerr << "  --shard i/N only process the listings in shard i of N, and write them" << endl;
+	cerr << "     to a shard file (-o) for --merge" << endl;
+	cerr << "  --shards N split the work between N local processes and merge their shards" << endl;
+	cerr << "  --since, --until time: only stored listings found in this window.  Either" << endl;
+	cerr << "     seconds since 1970 or how long ago (90m, 12h, 3d)" << endl;
+	cerr << "  --store <store> add every listing that is processed to this store" << endl;
+	cerr << "  --top K only the K most recent listings inside the --bbox" << endl;
 	cerr << "  -u (--url) [required]" << endl;
 	cerr << "      the Craigslist search page URL to be translated" << endl;
-	cerr << "  -v (--verbose) print messages to stderr";
+	cerr << "  -v (--verbose) print messages to stderr" << endl;
+	cerr << "  -w (--watch) check for new listings every this many seconds";
 	cerr << endl;
 }
 
@@ -251,6 +1253,188 @@ void parse_args(int argc, char* argv[])
 			}
 			maxListings = atoi(argv[++i]);
 		}
+		else if(strcmp(argv[i], "--deadline") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no number of seconds provided"<<endl;
+				exit(1);
+			}
+			deadlineSeconds = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--metrics") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no file base specified"<<endl;
+				exit(1);
+			}
+			metricsbase = argv[++i];
+		}
+		else if(strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no number of threads provided"<<endl;
+				exit(1);
+			}
+			cpuThreads = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--hedge") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no fraction provided"<<endl;
+				exit(1);
+			}
+			HostLatency::hedgeFraction = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--connections") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no number of connections provided"<<endl;
+				exit(1);
+			}
+			connections = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--shard") == 0)
+		{
+			if (i+1 == argc || sscanf(argv[i+1], "%d/%d", &shardIndex, &shardCount) != 2 || shardIndex < 0 || shardIndex >= shardCount) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: should look like 0/4"<<endl;
+				exit(1);
+			}
+			i++;
+		}
+		else if(strcmp(argv[i], "--shards") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no number of shards provided"<<endl;
+				exit(1);
+			}
+			localShards = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--merge") == 0)
+		{
+			while(i+1 < argc && argv[i+1][0] != '-')
+			{
+				mergeFiles.push_back(argv[++i]);
+			}
+			if (mergeFiles.empty()) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no shard files provided"<<endl;
+				exit(1);
+			}
+		}
+		else if(strcmp(argv[i], "--bbox") == 0)
+		{
+			double west, south, east, north;
+			if (i+1 == argc || sscanf(argv[i+1], "%lf,%lf,%lf,%lf", &west, &south, &east, &north) != 4 || south > north || west > east) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: should look like west,south,east,north"<<endl;
+				exit(1);
+			}
+			viewport = Bbox(north, south, east, west);
+			viewportSet = true;
+			i++;
+		}
+		else if(strcmp(argv[i], "--top") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no number of listings provided"<<endl;
+				exit(1);
+			}
+			topListings = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--store") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no store specified"<<endl;
+				exit(1);
+			}
+			storepath = argv[++i];
+		}
+		else if(strcmp(argv[i], "--from-store") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no store specified"<<endl;
+				exit(1);
+			}
+			fromstorepath = argv[++i];
+		}
+		else if(strcmp(argv[i], "--since") == 0 || strcmp(argv[i], "--until") == 0)
+		{
+			time_t when = (i+1 == argc) ? -1 : parse_time(argv[i+1]);
+			if (when < 0) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: should be a time like 1300000000 or 12h"<<endl;
+				exit(1);
+			}
+			if(strcmp(argv[i], "--since") == 0)
+				storeFilter.since = when;
+			else
+				storeFilter.until = when;
+			i++;
+		}
+		else if(strcmp(argv[i], "--keyword") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no keyword provided"<<endl;
+				exit(1);
+			}
+			storeFilter.keyword = argv[++i];
+		}
+		else if(strcmp(argv[i], "--price") == 0)
+		{
+			if (i+1 == argc || sscanf(argv[i+1], "%d,%d", &storeFilter.minPrice, &storeFilter.maxPrice) != 2) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: should look like 1000,2500"<<endl;
+				exit(1);
+			}
+			i++;
+		}
+		else if(strcmp(argv[i], "--gazetteer") == 0 || strcmp(argv[i], "-g") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no gazetteer specified"<<endl;
+				exit(1);
+			}
+			gazetteerpath = argv[++i];
+		}
+		else if(strcmp(argv[i], "--build-gazetteer") == 0)
+		{
+			if (i+2 >= argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: needs a CSV file and an index file"<<endl;
+				exit(1);
+			}
+			exit(Gazetteer::build(argv[i+1], argv[i+2], true) ? 0 : 1);
+		}
+		else if(strcmp(argv[i], "--state") == 0 || strcmp(argv[i], "-s") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no state file specified"<<endl;
+				exit(1);
+			}
+			statefilepath = argv[++i];
+		}
+		else if(strcmp(argv[i], "--watch") == 0 || strcmp(argv[i], "-w") == 0)
+		{
+			if (i+1 == argc) {
+				help();
+				cerr << "ERROR: Invalid "<<argv[i]<<" parameter: no interval provided"<<endl;
+				exit(1);
+			}
+			watchInterval = atof(argv[++i]);
+		}
 		else if(strcmp(argv[i], "--verbose") == 0 || strcmp(argv[i], "-v") == 0)
 		{
 			verbose=true;
@@ -268,6 +1452,63 @@ void parse_args(int argc, char* argv[])
 	}
 }
 
+// -----------------------------------------
+bool is_cached(const Listing& listing)
+{
+	// Webpage::loadFromCache treats an empty file as a miss
+	struct stat st;
+	return stat(Webpage::cachePath(listing.url.str()).c_str(), &st)==0 && st.st_size>0;
+}
+
+// -----------------------------------------
+bool job_is_cached(const ListingJob* job)
+{
+	return is_cached(*job->listing);
+}
+
+// -----------------------------------------
+// True if there isn't time left to spend 'needed' more seconds.
+bool time_is_up(double needed)
+{
+	if(stopRequested) return true;
+	return deadline>0 && Metrics::now()+needed > deadline;
+}
+
+// -----------------------------------------
+// Leave some of the budget for writing the file, once for each file
+// that has to be written after the requests are done.  Requests are cut
+// off at the same point, so none of them can run past it.
+void start_deadline(int writes)
+{
+	double reserve = min(1.0, deadlineSeconds*0.1);
+	deadline = Metrics::now() + deadlineSeconds - reserve*writes;
+	Webpage::deadline = deadline;
+}
+
+// -----------------------------------------
+// Only once the workers are idle and a crawl has copied what it keeps.
+void reset_worker_arenas()
+{
+	for(size_t i=0; i<workerArenas.size(); i++)
+	{
+		workerArenas[i]->reset();
+	}
+}
+
+// -----------------------------------------
+void request_stop(int sig)
+{
+	stopRequested = 1;
+}
+
+// -----------------------------------------
+void write_metrics()
+{
+	string base(metricsbase);
+	Metrics::writeJSON(base+".json");
+	Metrics::writePrometheus(base+".prom");
+}
+
 // -----------------------------------------
 string truncate(string str, int n)
 {
@@ -293,6 +1534,11 @@ map<string,string> default_config()
 	defaultConfig["craigslist_item_description"]	= "//div[@id='userbody']";
 	defaultConfig["user_agent"]						= "Mozilla/5.0";
 	defaultConfig["acceptable_url_re"]					= "^http://[^\\.]+\\.craigslist\\.org/.+";
+	defaultConfig["geocoder_url"]					= "http://maps.googleapis.com/maps/api/geocode/xml?sensor=false&address=";
+	defaultConfig["description_mode"]				= "html";
+	defaultConfig["description_max_bytes"]			= "2000";
+	defaultConfig["description_summary_bytes"]		= "200";
+	defaultConfig["description_template"]			= "no";
 	return defaultConfig;
 }
 